@@ -0,0 +1,278 @@
+/*
+ * Microbenchmarks for the shell's hot paths. shell.c is compiled into this
+ * file with its main() left out, so static helpers are called directly.
+ * Results go to stdout (or -o FILE) as one JSON object per line; a summary
+ * table goes to stderr. Build and run with "make bench".
+ */
+#define MAX_VAR 10000
+#define SHELL_NO_MAIN
+#include "../shell.c"
+#include <ftw.h>
+
+#define BENCH_MIN_NS 200000000ULL // keep running a benchmark for at least 0.2 s
+#define BENCH_PIDS 2000
+#define BENCH_CONNECTIONS 10000
+#define BENCH_LINE_BYTES (1 << 20)
+
+/* Allocation counters, fed by the linker's --wrap=malloc,--wrap=calloc,--wrap=realloc */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+static uint64_t allocations;
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+static FILE *results;
+static const char *commit = "unknown";
+static const char *filter = NULL;
+
+static void run_bench(const char *name, void (*op)(void *), void *ctx) {
+    if (filter && !strstr(name, filter)) {
+        return;
+    }
+    op(ctx); // warm up caches and lazily built tables
+
+    uint64_t iterations = 0, batch = 1, elapsed = 0, allocs = 0;
+    while (elapsed < BENCH_MIN_NS) {
+        uint64_t allocs_before = allocations;
+        uint64_t start = monotonic_ns();
+        for (uint64_t i = 0; i < batch; i++) {
+            op(ctx);
+        }
+        elapsed += monotonic_ns() - start;
+        allocs += allocations - allocs_before;
+        iterations += batch;
+        batch *= 2;
+    }
+
+    double ns_per_op = (double) elapsed / (double) iterations;
+    double allocs_per_op = (double) allocs / (double) iterations;
+    fprintf(stderr, "%-36s %12llu %14.1f %10.2f\n", name, (unsigned long long) iterations, ns_per_op, allocs_per_op);
+    fprintf(results, "{\"commit\":\"%s\",\"bench\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.1f,"
+                     "\"allocs_per_op\":%.2f}\n", commit, name, (unsigned long long) iterations, ns_per_op,
+            allocs_per_op);
+    fflush(results);
+}
+
+static void bench_parse_line(void *ctx) {
+    static Arena arena;
+    if (!parse_line(ctx, &arena)) {
+        abort();
+    }
+    arena_reset(&arena);
+}
+
+static void bench_get_variable_hit(void *ctx) {
+    if (!getVariable(ctx)) {
+        abort();
+    }
+}
+
+static void bench_get_variable_miss(void *ctx) {
+    if (getVariable(ctx)) {
+        abort();
+    }
+}
+
+static void bench_set_variable(void *ctx) {
+    setVariable(ctx, "updated");
+}
+
+static void bench_execute_dispatch(void *ctx) {
+    char *args[] = {"set", "bench_dispatch", "=", "1", NULL};
+    execute(args, 0, NULL);
+}
+
+static void bench_pstatus(void *ctx) {
+    char *args[] = {"pstatus", NULL};
+    ((int (*)(char **, int, const FdPlan *)) ctx)(args, 0, NULL);
+}
+
+static void bench_calculate_sessions(void *ctx) {
+    calculate_sessions(NULL);
+}
+
+static void bench_glob_word(void *ctx) {
+    char **paths;
+    if (glob_word(ctx, &paths) == 0) {
+        abort();
+    }
+    arena_reset(&line_arena);
+}
+
+static void bench_new_process(void *ctx) {
+    char *args[] = {"true", NULL};
+    newProcess(args, 0, NULL);
+}
+
+static void write_file(const char *path, const char *content) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fputs(content, fp);
+    fclose(fp);
+}
+
+/*
+ * Synthetic procfs: BENCH_PIDS processes with stat files, every fourth one
+ * multi-threaded, and net/tcp{,6} holding BENCH_CONNECTIONS sockets of which
+ * half are accepted on one of 16 listeners.
+ */
+static void build_proc_fixture(char *root) {
+    char path[512], line[512];
+    for (int pid = 1; pid <= BENCH_PIDS; pid++) {
+        snprintf(path, sizeof(path), "%s/%d", root, pid);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/%d/stat", root, pid);
+        snprintf(line, sizeof(line), "%d (bench%d) S %d %d %d %d -1 4194560 100 0 0 0 1 2 0 0 %d 0 %d 0 100 "
+                                     "1000000 200 18446744073709551615 0 0 0 0 0 0 0 0 0 0 0 0 17 0 0 0 0 0 0\n",
+                 pid, pid, pid / 2, pid, pid, pid % 3 ? 0 : 34816, pid % 40, 1 + pid % 4);
+        write_file(path, line);
+        snprintf(path, sizeof(path), "%s/%d/task", root, pid);
+        mkdir(path, 0755);
+        for (int tid = 0; tid < (pid % 4 == 0 ? 4 : 1); tid++) {
+            snprintf(path, sizeof(path), "%s/%d/task/%d", root, pid, pid * 10 + tid);
+            mkdir(path, 0755);
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/net", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/net/tcp", root);
+    FILE *fp = fopen(path, "w");
+    fprintf(fp, "  sl  local_address rem_address   st tx_queue rx_queue tr tm->when retrnsmt   uid  timeout inode\n");
+    for (int i = 0; i < 16; i++) {
+        fprintf(fp, "%4d: 00000000:%04X 00000000:0000 0A 00000000:00000000 00:00000000 00000000     0        0 %d "
+                    "1 0000000000000000 100 0 0 10 0\n", i, 8000 + i, 100 + i);
+    }
+    for (int i = 0; i < BENCH_CONNECTIONS; i++) {
+        int incoming = i % 2 == 0;
+        fprintf(fp, "%4d: 0100007F:%04X 0200007F:%04X 01 00000000:00000000 00:00000000 00000000  1000        0 %d "
+                    "1 0000000000000000 20 4 30 10 -1\n", 16 + i, incoming ? 8000 + i % 16 : 32768 + i % 28000,
+                incoming ? 32768 + i % 28000 : 443, 1000 + i);
+    }
+    fclose(fp);
+    snprintf(path, sizeof(path), "%s/net/tcp6", root);
+    write_file(path, "  sl  local_address                         remote_address                        st\n");
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    if (remove(path) < 0) {
+        perror(path);
+    }
+    return 0;
+}
+
+// Delete a fixture tree bottom-up without following symlinks
+static void remove_tree(const char *root) {
+    nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    const char *output = NULL;
+    while ((opt = getopt(argc, argv, "o:c:f:")) != -1) {
+        if (opt == 'o') {
+            output = optarg;
+        } else if (opt == 'c') {
+            commit = optarg;
+        } else if (opt == 'f') {
+            filter = optarg;
+        } else {
+            fprintf(stderr, "Usage: %s [-o results.json] [-c commit] [-f name-filter]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Builtins print to stdout, keep that away from the results
+    results = output ? fopen(output, "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!results) {
+        perror("Failed to open the results file");
+        return EXIT_FAILURE;
+    }
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    fprintf(stderr, "%-36s %12s %14s %10s\n", "Benchmark", "Iterations", "ns/op", "allocs/op");
+
+    run_bench("parse_line/short", bench_parse_line, "ls -la /tmp > listing.txt");
+
+    char *long_line = malloc(BENCH_LINE_BYTES + 1);
+    for (size_t i = 0; i < BENCH_LINE_BYTES; i++) {
+        long_line[i] = i % 8 == 7 ? ' ' : (char) ('a' + i % 26);
+    }
+    long_line[BENCH_LINE_BYTES] = '\0';
+    run_bench("parse_line/1MB", bench_parse_line, long_line);
+
+    TextBuffer script = {0};
+    for (int i = 0; i < 50; i++) {
+        const char *command = "ls -la /tmp > out.txt && grep -c x out.txt || echo none; ";
+        text_append(&script, command, strlen(command));
+    }
+    run_bench("parse_line/50-commands", bench_parse_line, script.data);
+
+    /* one 1 MB argument, mostly inside double quotes with a few escapes */
+    TextBuffer quoted = {0};
+    text_append(&quoted, "echo \"", 6);
+    for (size_t i = 0; quoted.length < BENCH_LINE_BYTES; i++) {
+        const char *piece = i % 64 == 63 ? "\\\" \\$x " : "quoted text ";
+        text_append(&quoted, piece, strlen(piece));
+    }
+    text_append(&quoted, "\" 'tail'", 8);
+    run_bench("parse_line/1MB-quoted", bench_parse_line, quoted.data);
+
+    char name[32], value[32];
+    for (int i = 0; i < MAX_VAR - 1; i++) {
+        snprintf(name, sizeof(name), "var%d", i);
+        snprintf(value, sizeof(value), "value%d", i);
+        setVariable(name, value);
+    }
+    snprintf(name, sizeof(name), "var%d", MAX_VAR - 2);
+    run_bench("getVariable/10k-last", bench_get_variable_hit, name);
+    run_bench("getVariable/10k-miss", bench_get_variable_miss, "missing");
+    run_bench("setVariable/10k-update", bench_set_variable, name);
+    run_bench("execute/dispatch-set", bench_execute_dispatch, NULL);
+
+    char root[] = "/tmp/shell-bench-XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("Failed to create the procfs fixture");
+        return EXIT_FAILURE;
+    }
+    build_proc_fixture(root);
+    proc_root = root;
+    run_bench("pstatus_p/2000-pids", bench_pstatus, pstatus_p);
+    run_bench("pstatus_i/2000-pids", bench_pstatus, pstatus_i);
+    run_bench("pstatus_t/2000-pids", bench_pstatus, pstatus_t);
+    use_sock_diag = 0;
+    run_bench("calculate_sessions/procfs-10k", bench_calculate_sessions, NULL);
+    proc_root = "/proc";
+    use_sock_diag = 1;
+    run_bench("calculate_sessions/live", bench_calculate_sessions, NULL);
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "%s/*7", root);
+    run_bench("glob_word/1000-entries", bench_glob_word, pattern);
+    snprintf(pattern, sizeof(pattern), "%s/1?/task/*", root);
+    run_bench("glob_word/10-dirs", bench_glob_word, pattern);
+    remove_tree(root);
+
+    run_bench("newProcess/true", bench_new_process, NULL);
+
+    fclose(results);
+    return 0;
+}
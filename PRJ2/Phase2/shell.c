@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -7,13 +8,45 @@
 #include <dirent.h>
 #include <ctype.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <spawn.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/sched.h>
 
 #define SYSCALL_NUMBER 333
+#ifndef MAX_VAR
 #define MAX_VAR 100
-#define MAX_PROCESSES 1024
-#define MAX_CONNECTIONS 1024
+#endif
 
-struct timeval start, end;
+const char *proc_root = "/proc"; // benchmarks point this at a synthetic tree
+int use_sock_diag = 1;           // 0 forces the /proc/net parsers
 
 typedef struct {
     int pid;
@@ -24,20 +57,29 @@ typedef struct {
 typedef struct {
     char name[50];
     char value[100];
+    int exported;
 } Variable;
 
 Variable variables[MAX_VAR];
 int varCount = 0;
 
+static int environment_dirty = 1; // an exported variable changed since child_environment() ran
+
 void setVariable(char *name, char *value) {
     for (int i = 0; i < varCount; i++) {
         if (strcmp(variables[i].name, name) == 0) {
-            strcpy(variables[i].value, value);
+            snprintf(variables[i].value, sizeof(variables[i].value), "%s", value);
+            environment_dirty |= variables[i].exported;
             return;
         }
     }
-    strcpy(variables[varCount].name, name);
-    strcpy(variables[varCount].value, value);
+    if (varCount >= MAX_VAR) {
+        fprintf(stderr, "Too many variables, %s was not set\n", name);
+        return;
+    }
+    snprintf(variables[varCount].name, sizeof(variables[varCount].name), "%s", name);
+    snprintf(variables[varCount].value, sizeof(variables[varCount].value), "%s", value);
+    variables[varCount].exported = 0;
     varCount++;
 }
 
@@ -50,57 +92,501 @@ char *getVariable(char *name) {
     return NULL;
 }
 
-int newProcess(char **args, int background, char *output) {
+extern char **environ;
+
+/*
+ * Environment handed to children: the inherited environ with exported
+ * variables added or overriding. It is rebuilt only after an exported
+ * variable changes, and is also installed as the shell's own environ so
+ * PATH lookups follow an exported PATH.
+ */
+static char **inherited_environ;
+static char **child_envp;
+static char *child_env_strings; // the exported "NAME=value" strings, in one block
+
+char **child_environment(void) {
+    if (!environment_dirty) {
+        return child_envp;
+    }
+    if (!inherited_environ) {
+        inherited_environ = environ;
+    }
+    size_t inherited = 0, exported = 0, bytes = 0;
+    for (; inherited_environ[inherited] != NULL; inherited++);
+    for (int i = 0; i < varCount; i++) {
+        if (variables[i].exported) {
+            exported++;
+            bytes += strlen(variables[i].name) + strlen(variables[i].value) + 2;
+        }
+    }
+    char **envp = malloc((inherited + exported + 1) * sizeof(char *));
+    char *strings = malloc(bytes ? bytes : 1);
+    if (!envp || !strings) {
+        free(envp);
+        free(strings);
+        return child_envp ? child_envp : environ; // keep the previous block
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < inherited; i++) {
+        const char *entry = inherited_environ[i];
+        size_t name_length = strcspn(entry, "=");
+        int overridden = 0;
+        for (int v = 0; v < varCount && !overridden; v++) {
+            overridden = variables[v].exported && strncmp(variables[v].name, entry, name_length) == 0 &&
+                         variables[v].name[name_length] == '\0';
+        }
+        if (!overridden) {
+            envp[count++] = inherited_environ[i];
+        }
+    }
+    char *next = strings;
+    for (int i = 0; i < varCount; i++) {
+        if (variables[i].exported) {
+            envp[count++] = next;
+            next += sprintf(next, "%s=%s", variables[i].name, variables[i].value) + 1;
+        }
+    }
+    envp[count] = NULL;
+
+    free(child_envp);
+    free(child_env_strings);
+    child_envp = envp;
+    child_env_strings = strings;
+    environ = child_envp;
+    environment_dirty = 0;
+    return child_envp;
+}
+
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (45 * HIST_SUB_BUCKETS) // values up to 2^48 ns, about 78 hours
+
+/*
+ * Log-linear latency histogram: every power of two is split into
+ * HIST_SUB_BUCKETS linear buckets, which keeps the relative error of a
+ * percentile under 1/HIST_SUB_BUCKETS at a fixed size.
+ */
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} LatencyHistogram;
+
+static int histogram_bucket(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) {
+        return (int) value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    int bucket = ((shift + 1) << HIST_SUB_BITS) + (int) ((value >> shift) - HIST_SUB_BUCKETS);
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+void histogram_record(LatencyHistogram *histogram, uint64_t value) {
+    histogram->counts[histogram_bucket(value)]++;
+    if (histogram->count == 0 || value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+    histogram->count++;
+    histogram->sum += value;
+}
+
+// Midpoint of the bucket holding the given percentile, clamped to the observed range
+uint64_t histogram_percentile(const LatencyHistogram *histogram, double percentile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (percentile / 100 * (double) histogram->count + 0.5);
+    rank = rank < 1 ? 1 : rank;
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+        seen += histogram->counts[bucket];
+        if (seen < rank) {
+            continue;
+        }
+        if (bucket < HIST_SUB_BUCKETS) {
+            return (uint64_t) bucket;
+        }
+        int shift = (bucket >> HIST_SUB_BITS) - 1;
+        uint64_t value = ((uint64_t) ((bucket & (HIST_SUB_BUCKETS - 1)) + HIST_SUB_BUCKETS) << shift) +
+                         ((1ULL << shift) >> 1);
+        return value < histogram->min ? histogram->min : value > histogram->max ? histogram->max : value;
+    }
+    return histogram->max;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+enum {
+    PHASE_PARSE, PHASE_DISPATCH, PHASE_SPAWN, PHASE_WAIT, PHASE_COUNT
+};
+
+static const char *phase_names[] = {"parse", "dispatch", "spawn", "wait"};
+
+uint64_t phase_elapsed[PHASE_COUNT]; // time the current command spent in each phase
+int phase_used[PHASE_COUNT];
+
+static void phase_add(int phase, uint64_t elapsed) {
+    phase_elapsed[phase] += elapsed;
+    phase_used[phase] = 1;
+}
+
+enum {
+    TRACE_READLINE, TRACE_PARSE, TRACE_EXPAND, TRACE_DISPATCH, TRACE_FORK, TRACE_EXEC, TRACE_WAITPID,
+    TRACE_FLUSH
+};
+
+static const char *trace_phase_names[] = {
+        "readLine", "parse", "expand", "dispatch", "fork", "exec", "waitpid", "flush"
+};
+
+#define TRACE_CAPACITY 65536 // events, a power of two
+#define TRACE_NAME_LENGTH 24
+
+typedef struct {
+    _Atomic uint64_t sequence; // claim index + 1 once the event is complete
+    uint64_t start;
+    uint64_t duration;
+    int32_t pid;
+    int32_t phase;
+    char name[TRACE_NAME_LENGTH];
+} TraceEvent;
+
+/*
+ * Ring of trace events in a MAP_SHARED mapping, so forked children record
+ * into the same buffer. Writers claim a slot with one fetch_add and never
+ * allocate; the oldest events are overwritten when the ring wraps.
+ */
+typedef struct {
+    _Atomic uint64_t head;
+    TraceEvent events[TRACE_CAPACITY];
+} TraceRing;
+
+TraceRing *trace_ring = NULL;
+pid_t trace_pid;
+
+void trace_event(int phase, uint64_t start, uint64_t end, const char *name) {
+    if (!trace_ring) {
+        return;
+    }
+    uint64_t index = atomic_fetch_add_explicit(&trace_ring->head, 1, memory_order_relaxed);
+    TraceEvent *event = &trace_ring->events[index & (TRACE_CAPACITY - 1)];
+    atomic_store_explicit(&event->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); /* readers see the slot invalid before any field changes */
+    event->start = start;
+    event->duration = end - start;
+    event->pid = trace_pid;
+    event->phase = phase;
+    size_t i = 0;
+    for (; name && name[i] && i < TRACE_NAME_LENGTH - 1; i++) {
+        event->name[i] = name[i];
+    }
+    event->name[i] = '\0';
+    atomic_store_explicit(&event->sequence, index + 1, memory_order_release);
+}
+
+struct rusage child_usage; // accumulated over the foreground children reaped by newProcess
+
+void add_rusage(struct rusage *total, const struct rusage *usage) {
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+    total->ru_minflt += usage->ru_minflt;
+    total->ru_majflt += usage->ru_majflt;
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+enum {
+    SPAWN_FORK, SPAWN_VFORK, SPAWN_POSIX_SPAWN, SPAWN_CLONE3, SPAWN_MODES
+};
+
+static const char *spawn_mode_names[] = {"fork", "vfork", "posix_spawn", "clone3"};
+
+/*
+ * Redirections of one command, computed once before it runs. Files are
+ * opened by the shell with O_CLOEXEC at fds >= PLAN_FD_BASE, so they
+ * never collide with fds 0-9 that a command can name and never leak into
+ * unrelated children. A child replays steps[] as dup2(source, fd) in
+ * source order; builtins use target[] instead, which says where each of
+ * fds 0-9 ends up without touching the shell's own fds.
+ */
+#define MAX_REDIRECT_FD 9
+#define PLAN_FD_BASE 10
+#define MAX_PLAN_STEPS 16
+
+typedef struct {
+    int count;
+    struct {
+        int fd;
+        int source;
+    } steps[MAX_PLAN_STEPS];
+    int opened[MAX_PLAN_STEPS]; // fds the shell opened, closed by plan_close()
+    int open_count;
+    int target[MAX_REDIRECT_FD + 1];
+} FdPlan;
+
+// The shell fd a builtin should use for fd: the redirect target, or fd itself
+static int redirect_target(const FdPlan *plan, int fd) {
+    return plan && fd <= MAX_REDIRECT_FD ? plan->target[fd] : fd;
+}
+
+// Child side: make the plan's fds real. Only dup2(), so it is safe after vfork()
+static int plan_apply(const FdPlan *plan) {
+    for (int i = 0; plan && i < plan->count; i++) {
+        int fd = plan->steps[i].fd, source = plan->steps[i].source;
+        if (source < 0) {
+            close(fd);
+        } else if (source != fd && dup2(source, fd) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void plan_close(FdPlan *plan) {
+    for (int i = 0; i < plan->open_count; i++) {
+        close(plan->opened[i]);
+    }
+    plan->open_count = 0;
+}
+
+/*
+ * Child side of a launch: apply the redirects and exec. Only syscalls once
+ * the environment is built, so it is also safe after vfork().
+ */
+static void exec_child(char **args, const FdPlan *redirects) {
+    if (plan_apply(redirects) < 0) {
+        perror("error in newProcess: redirect");
+        _exit(EXIT_FAILURE);
+    }
+    execvpe(args[0], args, child_environment());
+    perror("error in newProcess: child process");
+    _exit(EXIT_FAILURE);
+}
+
+/*
+ * Start args with the given strategy and return the child's pid, or -1 with
+ * errno set. clone3 is called without CLONE_VM, so it behaves like fork()
+ * minus glibc's atfork handlers.
+ */
+pid_t launch_process(char **args, const FdPlan *redirects, int mode) {
+    pid_t pid = -1;
+    child_environment(); /* rebuilt here if needed, never in a vfork child */
+    if (mode == SPAWN_FORK) {
+        pid = fork();
+        if (pid == 0) {
+            /* child process */
+            uint64_t exec_at = monotonic_ns();
+            trace_pid = getpid();
+            trace_event(TRACE_EXEC, exec_at, exec_at, args[0]); /* an instant: the moment exec is called */
+            exec_child(args, redirects);
+        }
+    } else if (mode == SPAWN_VFORK) {
+        pid = vfork();
+        if (pid == 0) {
+            exec_child(args, redirects);
+        }
+    } else if (mode == SPAWN_POSIX_SPAWN) {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        for (int i = 0; redirects && i < redirects->count; i++) {
+            if (redirects->steps[i].source < 0) {
+                posix_spawn_file_actions_addclose(&actions, redirects->steps[i].fd);
+            } else {
+                posix_spawn_file_actions_adddup2(&actions, redirects->steps[i].source, redirects->steps[i].fd);
+            }
+        }
+        int error = posix_spawnp(&pid, args[0], &actions, NULL, args, child_environment());
+        posix_spawn_file_actions_destroy(&actions);
+        if (error != 0) {
+            errno = error;
+            pid = -1;
+        }
+    } else {
+#ifdef SYS_clone3
+        struct clone_args clone = {0};
+        clone.exit_signal = SIGCHLD;
+        pid = syscall(SYS_clone3, &clone, sizeof(clone));
+        if (pid == 0) {
+            exec_child(args, redirects);
+        }
+#else
+        errno = ENOSYS;
+#endif
+    }
+    return pid;
+}
+
+#define JOB_COMMAND_LENGTH 128
+
+typedef struct {
+    int id;
     pid_t pid;
-    int status;
+    int status; // wait status once done
+    int done;
+    char command[JOB_COMMAND_LENGTH];
+} Job;
 
-    pid = fork();
-    if (pid == 0) {
-        if (output) {
-            int fd1 = creat(output, 0644);
-            dup2(fd1, STDOUT_FILENO);
-            close(fd1);
+static Job *job_table;
+static int job_count, job_capacity;
+
+void join_args(char **args, char *buffer, size_t size) {
+    size_t length = 0;
+    buffer[0] = '\0';
+    for (int i = 0; args[i] != NULL && length < size; i++) {
+        length += snprintf(buffer + length, size - length, "%s%s", i ? " " : "", args[i]);
+    }
+}
+
+// Register a background child and announce it as "[id] pid"
+int add_job(pid_t pid, const char *command) {
+    if (job_count >= job_capacity) {
+        int capacity = job_capacity ? 2 * job_capacity : 16;
+        Job *grown = realloc(job_table, capacity * sizeof(Job));
+        if (!grown) {
+            return -1;
         }
-        /* child process */
-        if (execvp(args[0], args) == -1) {
-            perror("error in newProcess: child process");
+        job_table = grown;
+        job_capacity = capacity;
+    }
+    Job *job = &job_table[job_count];
+    job->id = job_count ? job_table[job_count - 1].id + 1 : 1;
+    job->pid = pid;
+    job->status = 0;
+    job->done = 0;
+    snprintf(job->command, sizeof(job->command), "%s", command);
+    job_count++;
+    printf("[%d] %d\n", job->id, pid);
+    return job->id;
+}
+
+// Record the exit of a child reaped by some wait loop; returns 0 if it was not a job
+int job_exited(pid_t pid, int status) {
+    for (int i = 0; i < job_count; i++) {
+        if (job_table[i].pid == pid && !job_table[i].done) {
+            job_table[i].status = status;
+            job_table[i].done = 1;
+            return 1;
         }
-        exit(EXIT_FAILURE);
-    } else if (pid < 0) {
+    }
+    return 0;
+}
+
+static void print_job(const Job *job) {
+    char state[32];
+    if (!job->done) {
+        snprintf(state, sizeof(state), "Running");
+    } else if (WIFSIGNALED(job->status)) {
+        snprintf(state, sizeof(state), "Killed (signal %d)", WTERMSIG(job->status));
+    } else if (WEXITSTATUS(job->status) != 0) {
+        snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(job->status));
+    } else {
+        snprintf(state, sizeof(state), "Done");
+    }
+    printf("[%d] %-8d %-20s %s\n", job->id, job->pid, state, job->command);
+}
+
+/*
+ * Collect finished background children without blocking, then drop the
+ * finished jobs from the table, printing them first when report is set.
+ * Runs before every prompt, so a job is reported once, after it ends.
+ */
+void reap_jobs(int report) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        job_exited(pid, status);
+    }
+    int kept = 0;
+    for (int i = 0; i < job_count; i++) {
+        if (job_table[i].done) {
+            if (report) {
+                print_job(&job_table[i]);
+            }
+        } else {
+            job_table[kept++] = job_table[i];
+        }
+    }
+    job_count = kept;
+}
+
+int jobs_command(char **args, int background, const FdPlan *redirects) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        job_exited(pid, status);
+    }
+    for (int i = 0; i < job_count; i++) {
+        print_job(&job_table[i]);
+    }
+    reap_jobs(0); // the finished ones were just shown
+    return 0;
+}
+
+int newProcess(char **args, int background, const FdPlan *redirects) {
+    pid_t pid;
+    int status;
+    struct rusage usage;
+
+    uint64_t spawn_start = monotonic_ns();
+    pid = launch_process(args, redirects, SPAWN_FORK);
+    if (pid < 0) {
         /* error forking */
         perror("error in newProcess: forking");
     } else {
+        uint64_t wait_start = monotonic_ns();
+        phase_add(PHASE_SPAWN, wait_start - spawn_start);
+        trace_event(TRACE_FORK, spawn_start, wait_start, args[0]);
         if (!background) {
             /* parent process waits for child to complete */
             do {
-                waitpid(pid, &status, WUNTRACED);
+                if (wait4(pid, &status, WUNTRACED, &usage) < 0) {
+                    break;
+                }
             } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+            add_rusage(&child_usage, &usage);
+            uint64_t wait_end = monotonic_ns();
+            phase_add(PHASE_WAIT, wait_end - wait_start);
+            trace_event(TRACE_WAITPID, wait_start, wait_end, args[0]);
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                return 0;
+            }
         } else {
             /* parent process does not wait for child to complete */
-            printf("Process running in the background with PID %d\n", pid);
+            char command[JOB_COMMAND_LENGTH];
+            join_args(args, command, sizeof(command));
+            add_job(pid, command);
+            return 0;
         }
     }
     return (-1);
 }
 
-int ls(char **args, int background, char *outputfile) {
+int ls(char **args, int background, const FdPlan *redirects) {
     args[0] = "ls";
-    return newProcess(args, background, outputfile);
+    return newProcess(args, background, redirects);
 }
 
-int hls(char **args, int background, char *outputfile) {
+int hls(char **args, int background, const FdPlan *redirects) {
     struct dirent *de;
-    DIR *dr = opendir(args[1]);
+    DIR *dr = opendir(args[1] ? args[1] : ".");
     if (dr == NULL) // opendir returns NULL if couldn't open directory
     {
-        printf("Could not open current directory");
-        return 0;
-    }
-    int stdout_save = dup(STDOUT_FILENO);
-    if (outputfile) {
-        int fd1 = creat(outputfile, 0644);
-        dup2(fd1, STDOUT_FILENO);
-        close(fd1);
+        printf("Could not open current directory\n");
+        return -1;
     }
     while ((de = readdir(dr)) != NULL) {
         char *entry = de->d_name;
@@ -122,27 +608,24 @@ int hls(char **args, int background, char *outputfile) {
         }
         printf("%s\n", ent);
     }
-    if (outputfile) {
-        dup2(stdout_save, STDOUT_FILENO);
-        close(stdout_save);
-    }
     closedir(dr);
-    return (-1);
+    return 0;
 }
 
-int cd(char **args, int background, char *outputfile) {
+int cd(char **args, int background, const FdPlan *redirects) {
     if (args[1] == NULL) {
         fprintf(stderr, "expected argument to \"cd\"\n");
     } else {
-        if (chdir(args[1]) != 0) {
-            perror("error in cd.c: changing dir\n");
+        if (chdir(args[1]) == 0) {
+            return 0;
         }
+        perror("error in cd.c: changing dir\n");
     }
     return (-1);
 }
 
-int set(char **args, int background, char *outputfile) {
-    if (args[1] == NULL || args[2] == NULL || args[3] == NULL) {
+int set(char **args, int background, const FdPlan *redirects) {
+    if (args[1] == NULL || args[2] == NULL || args[3] == NULL || strcmp(args[2], "=") != 0) {
         fprintf(stderr, "Usage: set varname = value\n");
         return -1;
     }
@@ -152,7 +635,7 @@ int set(char **args, int background, char *outputfile) {
     return 0;
 }
 
-int get(char **args, int background, char *outputfile) {
+int get(char **args, int background, const FdPlan *redirects) {
     if (args[1] == NULL) {
         fprintf(stderr, "Usage: get varname\n");
         return -1;
@@ -160,36 +643,95 @@ int get(char **args, int background, char *outputfile) {
     char *value = getVariable(args[1]);
     if (value) {
         printf("%s\n", value);
-    } else {
-        printf("Variable not found\n");
+        return 0;
     }
-    return 0;
+    printf("Variable not found\n");
+    return -1;
+}
+
+int export_command(char **args, int background, const FdPlan *redirects) {
+    if (args[1] == NULL) {
+        for (int i = 0; i < varCount; i++) {
+            if (variables[i].exported) {
+                printf("export %s=%s\n", variables[i].name, variables[i].value);
+            }
+        }
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        char name[sizeof(variables[0].name)];
+        size_t length = strcspn(args[i], "=");
+        int valid = length > 0 && length < sizeof(name) && !isdigit((unsigned char) args[i][0]);
+        for (size_t j = 0; valid && j < length; j++) {
+            valid = isalnum((unsigned char) args[i][j]) || args[i][j] == '_';
+        }
+        if (!valid) {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", args[i]);
+            status = -1;
+            continue;
+        }
+        memcpy(name, args[i], length);
+        name[length] = '\0';
+        if (args[i][length] == '=') {
+            setVariable(name, args[i] + length + 1);
+        } else if (!getVariable(name)) {
+            char *inherited = getenv(name); /* export PATH keeps the inherited value */
+            setVariable(name, inherited ? inherited : "");
+        }
+        for (int v = 0; v < varCount; v++) {
+            if (strcmp(variables[v].name, name) == 0) {
+                variables[v].exported = 1;
+                environment_dirty = 1;
+            }
+        }
+    }
+    return status;
 }
 
-int cat(char **args, int background, char *outputfile) {
+int cat(char **args, int background, const FdPlan *redirects) {
     args[0] = "cat";
-    return newProcess(args, background, outputfile);
+    return newProcess(args, background, redirects);
 }
 
-int explain(char **args, int background, char *outputfile) {
+int explain(char **args, int background, const FdPlan *redirects) {
     printf("Available commands:\n");
     printf("_______________________\n");
     printf("set {var} = {value} : Set a variable with the specified name and value.\n");
     printf("get {var} : Get the value of the specified variable.\n");
+    printf("export {var}[={value}] ... : Pass the variables to every command started afterwards; alone, list them.\n");
     printf("ls : List directory contents.\n");
     printf("hls : List directory contents in a hidden way.\n");
     printf("cd {directory_path} : Change the current directory to the specified directory.\n");
     printf("cat {file_path} : Display the contents of the specified file.\n");
-    printf("${var} : Execute the command stored in the specified variable.\n");
-    printf("{command} & : Run the command in the background.\n");
+    printf("$var, ${var} : Replaced by the variable's value, or the environment's, anywhere in a command or redirect target.\n");
+    printf("${var} : Execute the command stored in the specified variable; unquoted values are split at blanks.\n");
+    printf("$? : Replaced by the status of the last command, 0 for success.\n");
+    printf("< file, > file, >> file, 2> file, 2>&1, &> file : Redirect a command's input, output (or append) and errors.\n");
+    printf("{command} & : Run the command, builtins included, in the background as a job.\n");
+    printf("jobs : List background jobs; finished ones are also reported before the next prompt.\n");
     printf("pstatus -p : List processes along with their parents, in descending order of priority.\n");
     printf("pstatus -i : List processes based on whether they are interactive or not.\n");
     printf("pstatus -t : List processes running on multiple threads.\n");
     printf("sysfo : Show system information.\n");
-    printf("nw -m : Display information of network.\n");
-    printf("nw -r : Restart measured values of network.\n");
-    printf("nw -d : Disconnect the system from the network.\n");
-    printf("nw -c : Connect the system to the network.\n");
+    printf("nw -m [-i iface,...] : Display information of network, for all or the listed interfaces.\n");
+    printf("nw -w {interval} [-n count] : Print network rates every interval (seconds, or ms with suffix).\n");
+    printf("nw -p [--full] : List processes by the number of sockets they own, with their states; --full rereads every fd table (done anyway when a socket has no known owner).\n");
+    printf("nw -s [-n top] : Summarize TCP states and the busiest local ports and peers.\n");
+    printf("nw -l {host:port} [-c n] [-j p] : Measure TCP connect latency with n probes, p in flight.\n");
+    printf("nw -b [--zerocopy] [--unix] [--size n] [--duration s] : Benchmark loopback send paths.\n");
+    printf("nw -r : Record a baseline that nw -m in any shell reports deltas and rates against.\n");
+    printf("nw -d {iface} [--wait [ms]] : Bring the interface down, optionally timing the carrier change.\n");
+    printf("nw -c {iface} [--wait [ms]] : Bring the interface up, optionally timing the carrier change.\n");
+    printf("time {command} : Run the command and report wall time, CPU time, max RSS, faults and context switches.\n");
+    printf("stats [--reset] : Show per-command parse, dispatch, spawn and wait latency percentiles.\n");
+    printf("trace on {file} | trace off : Record command phases and write them as Chrome trace JSON.\n");
+    printf("bench spawn [-n n] [-j p] [--mode m] [--inflate mb] {command} : Measure spawn throughput and latency.\n");
+    printf("history [n] : List the last n (default all) commands, shared through ~/.shell_history.\n");
+    printf("history -s {text} : Show the most recent commands containing the text.\n");
+    printf("!! | !{n} | !{prefix} : Run the last command, command n, or the last command starting with prefix.\n");
+    printf("parallel [-j n] {command} [{}] ::: {args} : Run the command once per argument, n at a time, output in order.\n");
+    printf("parallel [-j n] {command} : Same, with one argument per line read from stdin.\n");
     printf("? : Display this help message.\n");
     printf("exit : Exit the shell.\n");
     return 0;
@@ -201,13 +743,14 @@ int compare_priority(const void *a, const void *b) {
     return p2->priority - p1->priority; // Descending order
 }
 
-int pstatus_p(char **args, int background, char *outputfile) {
+int pstatus_p(char **args, int background, const FdPlan *redirects) {
     DIR *dir;
     struct dirent *entry;
-    ProcessInfo processes[MAX_PROCESSES];
+    static ProcessInfo *processes; // grown as needed and kept between calls
+    static int process_capacity;
     int process_count = 0;
 
-    if (!(dir = opendir("/proc"))) {
+    if (!(dir = opendir(proc_root))) {
         perror("Failed to open /proc");
         return -1;
     }
@@ -216,9 +759,21 @@ int pstatus_p(char **args, int background, char *outputfile) {
         int pid;
         if (sscanf(entry->d_name, "%d", &pid) == 1) {
             char path[256], buffer[1024];
-            sprintf(path, "/proc/%d/stat", pid);
+            snprintf(path, sizeof(path), "%s/%d/stat", proc_root, pid);
             FILE *fp = fopen(path, "r");
             if (fp) {
+                if (process_count >= process_capacity) {
+                    int capacity = process_capacity ? 2 * process_capacity : 1024;
+                    ProcessInfo *grown = realloc(processes, capacity * sizeof(ProcessInfo));
+                    if (!grown) {
+                        perror("Failed to allocate the process list");
+                        fclose(fp);
+                        closedir(dir);
+                        return -1;
+                    }
+                    processes = grown;
+                    process_capacity = capacity;
+                }
                 if (fgets(buffer, sizeof(buffer), fp)) {
                     ProcessInfo pinfo;
                     sscanf(buffer, "%d %*s %*c %d %*d %*d %*d %*d %*d %*d %*d %*d %*d %*d %*d %d", &pinfo.pid,
@@ -241,10 +796,10 @@ int pstatus_p(char **args, int background, char *outputfile) {
     return 0;
 }
 
-int pstatus_i(char **args, int background, char *outputfile) {
+int pstatus_i(char **args, int background, const FdPlan *redirects) {
     DIR *dir;
     struct dirent *entry;
-    if (!(dir = opendir("/proc"))) {
+    if (!(dir = opendir(proc_root))) {
         perror("Failed to open /proc");
         return -1;
     }
@@ -255,7 +810,7 @@ int pstatus_i(char **args, int background, char *outputfile) {
         int pid;
         if (sscanf(entry->d_name, "%d", &pid) == 1) { // Filter only directories with numeric names
             char path[256], buffer[1024];
-            sprintf(path, "/proc/%d/stat", pid);
+            snprintf(path, sizeof(path), "%s/%d/stat", proc_root, pid);
             FILE *fp = fopen(path, "r");
             if (fp) {
                 if (fgets(buffer, sizeof(buffer), fp)) {
@@ -272,10 +827,10 @@ int pstatus_i(char **args, int background, char *outputfile) {
     return 0;
 }
 
-int pstatus_t(char **args, int background, char *outputfile) {
+int pstatus_t(char **args, int background, const FdPlan *redirects) {
     DIR *dir, *task_dir;
     struct dirent *entry, *task_entry;
-    if (!(dir = opendir("/proc"))) {
+    if (!(dir = opendir(proc_root))) {
         perror("Failed to open /proc");
         return -1;
     }
@@ -287,7 +842,7 @@ int pstatus_t(char **args, int background, char *outputfile) {
         if (sscanf(entry->d_name, "%d", &pid) == 1) { // Filter only directories with numeric names
             char path[256];
             int thread_count = 0;
-            sprintf(path, "/proc/%d/task", pid);
+            snprintf(path, sizeof(path), "%s/%d/task", proc_root, pid);
             if ((task_dir = opendir(path))) {
                 while ((task_entry = readdir(task_dir)) != NULL) {
                     if (isdigit(task_entry->d_name[0])) {
@@ -305,170 +860,2191 @@ int pstatus_t(char **args, int background, char *outputfile) {
     return 0;
 }
 
-int sysfo(char **args, int background, char *outputfile) {
+// Print the lines of a procfs file that contain key, dropping repeats like "grep key | uniq"
+static void print_matching_lines(const char *name, const char *key) {
+    char path[256], line[512], previous[512] = "";
+    snprintf(path, sizeof(path), "%s/%s", proc_root, name);
+    FILE *fp = fopen(path, "re");
+    if (!fp) {
+        perror(path);
+        return;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (strstr(line, key) && strcmp(line, previous) != 0) {
+            fputs(line, stdout);
+            snprintf(previous, sizeof(previous), "%s", line);
+        }
+    }
+    fclose(fp);
+}
+
+/*
+ * Everything but top is read in the shell and printed to stdout, so a
+ * redirect of the builtin covers it; top goes through newProcess, which
+ * applies the same redirects to the child's fds.
+ */
+int sysfo(char **args, int background, const FdPlan *redirects) {
     printf("System Information:\n");
 
     // Print CPU model and number of cores
-    system("grep 'model name' /proc/cpuinfo | uniq");
-    system("grep 'cpu cores' /proc/cpuinfo | uniq");
+    print_matching_lines("cpuinfo", "model name");
+    print_matching_lines("cpuinfo", "cpu cores");
 
     // Print memory information
-    system("grep 'MemTotal' /proc/meminfo");
-    system("grep 'MemFree' /proc/meminfo");
+    print_matching_lines("meminfo", "MemTotal");
+    print_matching_lines("meminfo", "MemFree");
 
     // Print kernel version
-    system("uname -r");
+    struct utsname system_name;
+    if (uname(&system_name) == 0) {
+        printf("%s\n", system_name.release);
+    }
 
     // Include top command output, non-interactive mode
     printf("\nCurrent top processes:\n");
-    system("top -b -n 1");
-
-    return 0;
+    fflush(stdout); /* top writes to the fd directly, after everything above */
+    char *top_args[] = {"top", "-b", "-n", "1", NULL};
+    return newProcess(top_args, 0, redirects);
 }
 
 
-void fetch_active_listening_ports(int active_ports[], int *count_ports) {
-    FILE *netstat_data = popen("netstat -tln | awk '/^tcp/ {print $4}'", "r");
-    if (!netstat_data) {
-        perror("Failed to execute netstat command");
-        exit(EXIT_FAILURE);
+typedef struct {
+    int family;     // AF_INET or AF_INET6
+    int protocol;   // IPPROTO_TCP or IPPROTO_UDP
+    int state;      // TCP_* state as reported by the kernel (UDP uses ESTABLISHED/CLOSE)
+    unsigned char local_addr[16];
+    unsigned char remote_addr[16];
+    uint16_t local_port;
+    uint16_t remote_port;
+    uint32_t inode;
+    uint32_t uid;
+} SocketInfo;
+
+typedef void (*socket_visitor)(const SocketInfo *sock, void *ctx);
+
+#define SOCK_STATE_BIT(state) (1U << (state))
+#define SOCK_STATES_ALL 0xfffU
+
+static long netlink_buffer[16384]; // 128KB, large enough to drain a dump in few recv() calls
+
+/*
+ * Dump sockets of one family/protocol through NETLINK_SOCK_DIAG. The kernel
+ * filters by state and hands back binary records, so no text is parsed.
+ * Returns 0 on success, -1 if the netlink backend is unavailable and -2 if
+ * the dump failed after some sockets were already passed to visit.
+ */
+static int sock_diag_dump(int family, int protocol, uint32_t states, socket_visitor visit, void *ctx) {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct {
+        struct nlmsghdr nlh;
+        struct inet_diag_req_v2 req;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.nlh.nlmsg_len = sizeof(request);
+    request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.req.sdiag_family = family;
+    request.req.sdiag_protocol = protocol;
+    request.req.idiag_states = states;
+
+    struct sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+    if (sendto(fd, &request, sizeof(request), 0, (struct sockaddr *) &kernel, sizeof(kernel)) < 0) {
+        close(fd);
+        return -1;
     }
 
-    *count_ports = 0;
-    char buffer[256];
-    while (fgets(buffer, sizeof(buffer), netstat_data)) {
-        if (*count_ports >= MAX_CONNECTIONS) {
-            fprintf(stderr, "Exceeded the max allowed ports. Increase MAX_CONNECTIONS.\n");
-            exit(EXIT_FAILURE);
+    int visited = 0;
+    for (;;) {
+        ssize_t len = recv(fd, netlink_buffer, sizeof(netlink_buffer), 0);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return visited ? -2 : -1;
         }
-        int port_number;
-        if (sscanf(buffer, "%*[^:]:%d", &port_number) == 1) {
-            active_ports[(*count_ports)++] = port_number;
+        struct nlmsghdr *nlh = (struct nlmsghdr *) netlink_buffer;
+        for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                close(fd);
+                return 0;
+            }
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr *err = NLMSG_DATA(nlh);
+                errno = err->error ? -err->error : EIO;
+                close(fd);
+                return visited ? -2 : -1;
+            }
+            struct inet_diag_msg *msg = NLMSG_DATA(nlh);
+            SocketInfo sock;
+            sock.family = msg->idiag_family;
+            sock.protocol = protocol;
+            sock.state = msg->idiag_state;
+            memcpy(sock.local_addr, msg->id.idiag_src, sizeof(sock.local_addr));
+            memcpy(sock.remote_addr, msg->id.idiag_dst, sizeof(sock.remote_addr));
+            sock.local_port = ntohs(msg->id.idiag_sport);
+            sock.remote_port = ntohs(msg->id.idiag_dport);
+            sock.inode = msg->idiag_inode;
+            sock.uid = msg->idiag_uid;
+            visit(&sock, ctx);
+            visited = 1;
         }
     }
-
-    pclose(netstat_data);
 }
 
-int check_for_incoming(int port, int ports_list[], int total_ports) {
-    for (int index = 0; index < total_ports; index++) {
-        if (ports_list[index] == port) {
-            return 1; // Found the port
+// Parse "AABBCCDD:PORT" style hex fields of /proc/net/{tcp,udp}{,6}
+static const char *parse_proc_address(const char *p, unsigned char *addr, int words, uint16_t *port) {
+    for (int w = 0; w < words; w++) {
+        uint32_t word = 0;
+        for (int i = 0; i < 8; i++, p++) {
+            word = (word << 4) | (uint32_t) (isdigit((unsigned char) *p) ? *p - '0' : (*p | 0x20) - 'a' + 10);
         }
+        memcpy(addr + 4 * w, &word, 4); // the kernel prints the raw network-order word
+    }
+    if (*p++ != ':') {
+        return NULL;
     }
-    return 0; // Port not found
+    *port = (uint16_t) strtoul(p, (char **) &p, 16);
+    return p;
 }
 
-int calculate_sessions() {
-    int local_listening_ports[MAX_CONNECTIONS];
-    int count_of_ports = 0;
-
-    // Retrieve locally listening TCP ports
-    fetch_active_listening_ports(local_listening_ports, &count_of_ports);
+/*
+ * Fallback for kernels without inet_diag: walk /proc/net/tcp{,6} or udp{,6}
+ * directly instead of going through netstat.
+ */
+static int proc_net_dump(int family, int protocol, uint32_t states, socket_visitor visit, void *ctx) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/net/%s%s", proc_root, protocol == IPPROTO_TCP ? "tcp" : "udp",
+             family == AF_INET6 ? "6" : "");
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
 
-    // Collect and evaluate network sessions
-    FILE *netstat_data = popen("netstat -tn | awk '/^tcp/ {print $4}'", "r");
-    if (!netstat_data) {
-        perror("Failed to execute netstat command");
-        exit(EXIT_FAILURE);
+    int words = family == AF_INET6 ? 4 : 1;
+    char buffer[512];
+    fgets(buffer, sizeof(buffer), fp); // skip the header line
+    while (fgets(buffer, sizeof(buffer), fp)) {
+        SocketInfo sock;
+        memset(&sock, 0, sizeof(sock));
+        sock.family = family;
+        sock.protocol = protocol;
+        const char *p = strchr(buffer, ':');
+        if (!p) {
+            continue;
+        }
+        p += 2;
+        if (!(p = parse_proc_address(p, sock.local_addr, words, &sock.local_port))) {
+            continue;
+        }
+        if (!(p = parse_proc_address(p + 1, sock.remote_addr, words, &sock.remote_port))) {
+            continue;
+        }
+        char *end;
+        sock.state = (int) strtol(p, &end, 16);
+        if (!(states & SOCK_STATE_BIT(sock.state))) {
+            continue;
+        }
+        unsigned long uid, inode;
+        // tx:rx queues, tr:tm->when, retrnsmt, uid, timeout, inode
+        if (sscanf(end, "%*x:%*x %*x:%*x %*x %lu %*d %lu", &uid, &inode) == 2) {
+            sock.uid = (uint32_t) uid;
+            sock.inode = (uint32_t) inode;
+        }
+        visit(&sock, ctx);
     }
 
-    int count_incoming = 0;
-    int count_outgoing = 0;
-    char buffer[256];
-    while (fgets(buffer, sizeof(buffer), netstat_data)) {
-        int port;
-        if (sscanf(buffer, "%*[^:]:%d", &port) == 1) {
-            int incoming = check_for_incoming(port, local_listening_ports, count_of_ports);
-            if (incoming) {
-                count_incoming++;
-            } else {
-                count_outgoing++;
-            }
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * Enumerate IPv4 and IPv6 sockets of a protocol whose state is in the
+ * SOCK_STATE_BIT() mask. Within a family, listening sockets are always
+ * reported before connected ones. Returns -1 if no backend could be read,
+ * or if a sock_diag dump broke off after some sockets were already visited:
+ * repeating them from /proc/net would count them twice.
+ */
+int enumerate_sockets(int protocol, uint32_t states, socket_visitor visit, void *ctx) {
+    const int families[] = {AF_INET, AF_INET6};
+    int found = 0;
+    for (int i = 0; i < 2; i++) {
+        int status = use_sock_diag ? sock_diag_dump(families[i], protocol, states, visit, ctx) : -1;
+        if (status == -2) {
+            return -1;
+        }
+        if (status == 0 || proc_net_dump(families[i], protocol, states, visit, ctx) == 0) {
+            found = 1;
         }
     }
+    return found ? 0 : -1;
+}
 
-    pclose(netstat_data);
+#define PORT_BITMAP_WORDS (65536 / 64)
 
-    printf("Number of incoming sessions: %d\n", count_incoming);
-    printf("Number of outgoing sessions: %d\n", count_outgoing);
+typedef struct {
+    unsigned char addr[16];
+    uint16_t port;
+    uint8_t used;
+} ListenAddr;
 
-    return 0;
+/*
+ * Listening sockets of one address family. Wildcard binds (0.0.0.0 / ::)
+ * only need their port recorded; address-specific binds additionally go in
+ * an open-addressing table keyed by (address, port).
+ */
+typedef struct {
+    uint64_t wildcard[PORT_BITMAP_WORDS];
+    uint64_t bound[PORT_BITMAP_WORDS];
+    ListenAddr *addrs;
+    size_t addr_count;
+    size_t addr_capacity; // power of two
+} PortIndex;
+
+#define PORT_BIT_SET(map, port) ((map)[(port) >> 6] |= 1ULL << ((port) & 63))
+#define PORT_BIT_TEST(map, port) (((map)[(port) >> 6] >> ((port) & 63)) & 1)
+
+static size_t listen_addr_hash(const unsigned char *addr, uint16_t port, size_t mask) {
+    uint64_t h = 1469598103934665603ULL ^ port;
+    for (int i = 0; i < 16; i++) {
+        h = (h ^ addr[i]) * 1099511628211ULL;
+    }
+    return (size_t) (h ^ (h >> 32)) & mask;
 }
 
-void display_interface_traffic(const char *network_interface) {
-    FILE *dev_file;
-    char buffer[1024];
-    char *line_pointer, *data_token, *next_token;
-    unsigned long received_bytes = 0, sent_bytes = 0;
+static ListenAddr *port_index_slot(ListenAddr *table, size_t capacity, const unsigned char *addr, uint16_t port) {
+    size_t mask = capacity - 1;
+    size_t i = listen_addr_hash(addr, port, mask);
+    while (table[i].used && (table[i].port != port || memcmp(table[i].addr, addr, 16) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
 
-    dev_file = fopen("/proc/net/dev", "r");
-    if (!dev_file) {
-        perror("Failed to open /proc/net/dev");
-        return;
+void port_index_reset(PortIndex *index) {
+    memset(index->wildcard, 0, sizeof(index->wildcard));
+    memset(index->bound, 0, sizeof(index->bound));
+    if (index->addrs) {
+        memset(index->addrs, 0, index->addr_capacity * sizeof(ListenAddr));
     }
+    index->addr_count = 0;
+}
 
-    while (fgets(buffer, sizeof(buffer), dev_file) != NULL) {
-        if ((line_pointer = strstr(buffer, network_interface)) != NULL) {
-            strtok(line_pointer, ":");
-            data_token = strtok(NULL, " ");
-            for (int i = 0; i < 9; i++) {
-                next_token = strtok(NULL, " ");
-            }
-            received_bytes = strtoul(data_token, NULL, 10);
-            sent_bytes = strtoul(next_token, NULL, 10);
-            break;
+void port_index_add(PortIndex *index, const unsigned char *addr, uint16_t port) {
+    static const unsigned char any[16];
+    if (memcmp(addr, any, 16) == 0) {
+        PORT_BIT_SET(index->wildcard, port);
+        return;
+    }
+    if (2 * (index->addr_count + 1) > index->addr_capacity) {
+        size_t capacity = index->addr_capacity ? 2 * index->addr_capacity : 64;
+        ListenAddr *table = calloc(capacity, sizeof(ListenAddr));
+        if (!table) {
+            fprintf(stderr, "allocation error in port_index_add: table\n");
+            return;
+        }
+        for (size_t i = 0; i < index->addr_capacity; i++) {
+            if (index->addrs[i].used) {
+                *port_index_slot(table, capacity, index->addrs[i].addr, index->addrs[i].port) = index->addrs[i];
+            }
         }
+        free(index->addrs);
+        index->addrs = table;
+        index->addr_capacity = capacity;
     }
+    ListenAddr *slot = port_index_slot(index->addrs, index->addr_capacity, addr, port);
+    if (!slot->used) {
+        memcpy(slot->addr, addr, 16);
+        slot->port = port;
+        slot->used = 1;
+        index->addr_count++;
+    }
+    PORT_BIT_SET(index->bound, port);
+}
 
-    fclose(dev_file);
-
-    printf("Incoming traffic on %s: %lu bytes\n", network_interface, received_bytes);
-    printf("Outgoing traffic on %s: %lu bytes\n", network_interface, sent_bytes);
+// A connection is incoming if something listens on its local address and port
+int check_for_incoming(const PortIndex *index, const unsigned char *addr, uint16_t port) {
+    if (PORT_BIT_TEST(index->wildcard, port)) {
+        return 1;
+    }
+    if (!PORT_BIT_TEST(index->bound, port)) {
+        return 0;
+    }
+    return port_index_slot(index->addrs, index->addr_capacity, addr, port)->used;
 }
 
+typedef struct {
+    int incoming;
+    int outgoing;
+} SessionCounts;
 
-int nw_m(char **args, int background, char *outputfile) {
-    syscall(SYSCALL_NUMBER, 4);  // Example syscall for network data
-    calculate_sessions();
-    display_interface_traffic("ens33");
-    gettimeofday(&end, NULL);
-    printf("Time in microseconds: %ld microseconds\n",
-           ((end.tv_sec - start.tv_sec) * 1000000L + end.tv_usec) - start.tv_usec);
-    return 0;
-}
+typedef struct {
+    uint32_t *items;
+    size_t count;
+    size_t capacity;
+} InodeSet;
 
-int nw_r(char **args, int background, char *outputfile) {
-    syscall(SYSCALL_NUMBER, 3); // Example syscall for restarting monitoring
-    gettimeofday(&start, NULL);
-    return 0;
+typedef struct {
+    PortIndex listeners[2]; // per family: [0] IPv4, [1] IPv6
+    SessionCounts *counts;
+    InodeSet *inodes;       // optional, collects inodes of connected sockets
+} SessionScan;
+
+static void inode_set_add(InodeSet *set, uint32_t inode) {
+    if (set->count >= set->capacity) {
+        size_t capacity = set->capacity ? 2 * set->capacity : 1024;
+        uint32_t *items = realloc(set->items, capacity * sizeof(uint32_t));
+        if (!items) {
+            fprintf(stderr, "allocation error in inode_set_add: items\n");
+            return;
+        }
+        set->items = items;
+        set->capacity = capacity;
+    }
+    set->items[set->count++] = inode;
 }
 
-int nw_d(char **args, int background, char *outputfile) {
-    syscall(SYSCALL_NUMBER, 1); // Example syscall for stopping connection
-    system("ifconfig ens33 down");
-    return 0;
+static void classify_session(const SocketInfo *sock, void *ctx) {
+    SessionScan *scan = ctx;
+    PortIndex *index = &scan->listeners[sock->family == AF_INET6];
+    if (sock->state == TCP_LISTEN) {
+        port_index_add(index, sock->local_addr, sock->local_port);
+        return;
+    }
+    // Listeners of a family precede its connections, so the index is complete here
+    if (check_for_incoming(index, sock->local_addr, sock->local_port)) {
+        scan->counts->incoming++;
+    } else {
+        scan->counts->outgoing++;
+    }
+    if (scan->inodes && sock->inode != 0) { // TIME_WAIT sockets have no inode
+        inode_set_add(scan->inodes, sock->inode);
+    }
 }
 
-int nw_c(char **args, int background, char *outputfile) {
-    syscall(SYSCALL_NUMBER, 2); // Example syscall for starting connection
-    system("ifconfig ens33 up");
-    return 0;
+/*
+ * Count incoming/outgoing TCP sessions in a single pass over the socket
+ * table. If inodes is not NULL it receives the connected sockets' inodes.
+ */
+int count_sessions(SessionCounts *counts, InodeSet *inodes) {
+    static SessionScan scan;
+    counts->incoming = 0;
+    counts->outgoing = 0;
+    port_index_reset(&scan.listeners[0]);
+    port_index_reset(&scan.listeners[1]);
+    scan.counts = counts;
+    scan.inodes = inodes;
+    if (inodes) {
+        inodes->count = 0;
+    }
+    return enumerate_sockets(IPPROTO_TCP, SOCK_STATES_ALL, classify_session, &scan);
 }
 
-int nw_handler(char **args, int background, char *outputfile) {
-    if (args[1] == NULL) {
-        printf("Usage: nw -m | -r | -d | -c\n");
+// Print session counts, and their change since a baseline when one is given
+int calculate_sessions(const SessionCounts *since) {
+    SessionCounts counts;
+    if (count_sessions(&counts, NULL) < 0) {
+        perror("Failed to read the socket table");
         return -1;
     }
-    if (strcmp(args[1], "-m") == 0) {
-        return nw_m(args, background, outputfile);
-    } else if (strcmp(args[1], "-r") == 0) {
-        return nw_r(args, background, outputfile);
-    } else if (strcmp(args[1], "-d") == 0) {
-        return nw_d(args, background, outputfile);
-    } else if (strcmp(args[1], "-c") == 0) {
-        return nw_c(args, background, outputfile);
+
+    if (since) {
+        printf("Number of incoming sessions: %d (%+d since baseline)\n", counts.incoming,
+               counts.incoming - since->incoming);
+        printf("Number of outgoing sessions: %d (%+d since baseline)\n", counts.outgoing,
+               counts.outgoing - since->outgoing);
+    } else {
+        printf("Number of incoming sessions: %d\n", counts.incoming);
+        printf("Number of outgoing sessions: %d\n", counts.outgoing);
+    }
+
+    return 0;
+}
+
+typedef struct {
+    char name[IF_NAMESIZE];
+    int index;
+    unsigned int flags;
+    uint64_t rx_bytes, tx_bytes;
+    uint64_t rx_packets, tx_packets;
+    uint64_t rx_errors, tx_errors;
+    uint64_t rx_dropped, tx_dropped;
+} InterfaceStats;
+
+typedef struct {
+    InterfaceStats *entries;
+    int count;
+    int capacity;
+} InterfaceTable;
+
+static InterfaceStats *interface_table_add(InterfaceTable *table) {
+    if (table->count >= table->capacity) {
+        int capacity = table->capacity ? 2 * table->capacity : 16;
+        InterfaceStats *entries = realloc(table->entries, capacity * sizeof(InterfaceStats));
+        if (!entries) {
+            fprintf(stderr, "allocation error in interface_table_add: entries\n");
+            return NULL;
+        }
+        table->entries = entries;
+        table->capacity = capacity;
+    }
+    InterfaceStats *entry = &table->entries[table->count++];
+    memset(entry, 0, sizeof(*entry));
+    return entry;
+}
+
+static void parse_link_message(InterfaceTable *table, struct nlmsghdr *nlh) {
+    struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+    InterfaceStats *entry = interface_table_add(table);
+    if (!entry) {
+        return;
+    }
+    entry->index = ifi->ifi_index;
+    entry->flags = ifi->ifi_flags;
+
+    int have_stats64 = 0;
+    int len = IFLA_PAYLOAD(nlh);
+    for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFLA_IFNAME) {
+            snprintf(entry->name, sizeof(entry->name), "%s", (char *) RTA_DATA(rta));
+        } else if (rta->rta_type == IFLA_STATS64 && RTA_PAYLOAD(rta) >= sizeof(struct rtnl_link_stats64)) {
+            struct rtnl_link_stats64 stats; // attributes are only 4-byte aligned
+            memcpy(&stats, RTA_DATA(rta), sizeof(stats));
+            entry->rx_bytes = stats.rx_bytes;
+            entry->tx_bytes = stats.tx_bytes;
+            entry->rx_packets = stats.rx_packets;
+            entry->tx_packets = stats.tx_packets;
+            entry->rx_errors = stats.rx_errors;
+            entry->tx_errors = stats.tx_errors;
+            entry->rx_dropped = stats.rx_dropped;
+            entry->tx_dropped = stats.tx_dropped;
+            have_stats64 = 1;
+        } else if (rta->rta_type == IFLA_STATS && !have_stats64 &&
+                   RTA_PAYLOAD(rta) >= sizeof(struct rtnl_link_stats)) {
+            struct rtnl_link_stats stats;
+            memcpy(&stats, RTA_DATA(rta), sizeof(stats));
+            entry->rx_bytes = stats.rx_bytes;
+            entry->tx_bytes = stats.tx_bytes;
+            entry->rx_packets = stats.rx_packets;
+            entry->tx_packets = stats.tx_packets;
+            entry->rx_errors = stats.rx_errors;
+            entry->tx_errors = stats.tx_errors;
+            entry->rx_dropped = stats.rx_dropped;
+            entry->tx_dropped = stats.tx_dropped;
+        }
+    }
+}
+
+// Fetch every link with its 64-bit counters in a single RTM_GETLINK dump
+static int rtnl_link_dump(InterfaceTable *table) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct {
+        struct nlmsghdr nlh;
+        struct ifinfomsg ifi;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.nlh.nlmsg_len = sizeof(request);
+    request.nlh.nlmsg_type = RTM_GETLINK;
+    request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.ifi.ifi_family = AF_UNSPEC;
+
+    struct sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+    if (sendto(fd, &request, sizeof(request), 0, (struct sockaddr *) &kernel, sizeof(kernel)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    for (;;) {
+        ssize_t len = recv(fd, netlink_buffer, sizeof(netlink_buffer), 0);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        struct nlmsghdr *nlh = (struct nlmsghdr *) netlink_buffer;
+        for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                close(fd);
+                return 0;
+            }
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                close(fd);
+                return -1;
+            }
+            if (nlh->nlmsg_type == RTM_NEWLINK) {
+                parse_link_message(table, nlh);
+            }
+        }
+    }
+}
+
+// Fallback: parse /proc/net/dev with strtoull cursors instead of strtok
+static int proc_net_dev_dump(InterfaceTable *table) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/net/dev", proc_root);
+    FILE *dev_file = fopen(path, "r");
+    if (!dev_file) {
+        return -1;
+    }
+
+    char buffer[1024];
+    while (fgets(buffer, sizeof(buffer), dev_file) != NULL) {
+        char *colon = strchr(buffer, ':');
+        if (!colon) {
+            continue; // the two header lines have no "name:" prefix
+        }
+        *colon = '\0';
+        char *name = buffer;
+        while (*name == ' ') {
+            name++;
+        }
+
+        uint64_t fields[16];
+        char *cursor = colon + 1;
+        int n = 0;
+        for (; n < 16; n++) {
+            char *next;
+            fields[n] = strtoull(cursor, &next, 10);
+            if (next == cursor) {
+                break;
+            }
+            cursor = next;
+        }
+        if (n < 16) {
+            continue;
+        }
+
+        InterfaceStats *entry = interface_table_add(table);
+        if (!entry) {
+            break;
+        }
+        snprintf(entry->name, sizeof(entry->name), "%.*s", IF_NAMESIZE - 1, name);
+        entry->index = (int) if_nametoindex(entry->name);
+        entry->rx_bytes = fields[0];
+        entry->rx_packets = fields[1];
+        entry->rx_errors = fields[2];
+        entry->rx_dropped = fields[3];
+        entry->tx_bytes = fields[8];
+        entry->tx_packets = fields[9];
+        entry->tx_errors = fields[10];
+        entry->tx_dropped = fields[11];
+    }
+
+    fclose(dev_file);
+    return 0;
+}
+
+int collect_interface_stats(InterfaceTable *table) {
+    table->count = 0;
+    if (rtnl_link_dump(table) == 0) {
+        return 0;
+    }
+    table->count = 0;
+    return proc_net_dev_dump(table);
+}
+
+// Match an interface against a comma separated list, NULL selects all of them
+static int interface_selected(const char *name, const char *list) {
+    if (list == NULL) {
+        return 1;
+    }
+    size_t len = strlen(name);
+    for (const char *p = list; *p;) {
+        const char *comma = strchr(p, ',');
+        size_t item = comma ? (size_t) (comma - p) : strlen(p);
+        if (item == len && strncmp(p, name, len) == 0) {
+            return 1;
+        }
+        if (!comma) {
+            break;
+        }
+        p = comma + 1;
+    }
+    return 0;
+}
+
+typedef struct {
+    InterfaceTable interfaces;
+    SessionCounts sessions;
+    InodeSet inodes; // sorted
+    struct timespec taken;
+} NetSnapshot;
+
+static int compare_inode(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+int take_net_snapshot(NetSnapshot *snapshot) {
+    clock_gettime(CLOCK_MONOTONIC, &snapshot->taken);
+    if (collect_interface_stats(&snapshot->interfaces) < 0 ||
+        count_sessions(&snapshot->sessions, &snapshot->inodes) < 0) {
+        return -1;
+    }
+    qsort(snapshot->inodes.items, snapshot->inodes.count, sizeof(uint32_t), compare_inode);
+    return 0;
+}
+
+// Walk both sorted inode lists once to count connections that appeared or went away
+static void count_churn(const InodeSet *before, const InodeSet *after, int *opened, int *closed) {
+    size_t i = 0, j = 0;
+    *opened = *closed = 0;
+    while (i < before->count && j < after->count) {
+        if (before->items[i] == after->items[j]) {
+            i++, j++;
+        } else if (before->items[i] < after->items[j]) {
+            (*closed)++, i++;
+        } else {
+            (*opened)++, j++;
+        }
+    }
+    *closed += (int) (before->count - i);
+    *opened += (int) (after->count - j);
+}
+
+// Find the previous sample of an interface, usually at the same position
+static const InterfaceStats *find_interface(const InterfaceTable *table, int position, int index) {
+    if (position < table->count && table->entries[position].index == index) {
+        return &table->entries[position];
+    }
+    for (int i = 0; i < table->count; i++) {
+        if (table->entries[i].index == index) {
+            return &table->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static const char *format_rate(double bytes_per_second, char *buffer, size_t size) {
+    const char *units[] = {"B/s", "KB/s", "MB/s", "GB/s"};
+    int unit = 0;
+    while (bytes_per_second >= 1024 && unit < 3) {
+        bytes_per_second /= 1024;
+        unit++;
+    }
+    snprintf(buffer, size, "%.1f %s", bytes_per_second, units[unit]);
+    return buffer;
+}
+
+static double timespec_seconds(const struct timespec *from, const struct timespec *to) {
+    return (double) (to->tv_sec - from->tv_sec) + (double) (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void print_net_rates(const NetSnapshot *before, const NetSnapshot *after, const char *interface_list) {
+    double elapsed = timespec_seconds(&before->taken, &after->taken);
+    int opened, closed;
+    count_churn(&before->inodes, &after->inodes, &opened, &closed);
+    printf("Sessions: %d incoming, %d outgoing (+%d opened, -%d closed) over %.3fs\n",
+           after->sessions.incoming, after->sessions.outgoing, opened, closed, elapsed);
+    printf("%-16s %14s %14s %10s %10s %7s %7s %7s %7s\n", "Interface", "RX", "TX", "RX pkt/s", "TX pkt/s",
+           "RX err", "TX err", "RX drop", "TX drop");
+    for (int i = 0; i < after->interfaces.count; i++) {
+        const InterfaceStats *now = &after->interfaces.entries[i];
+        const InterfaceStats *then = find_interface(&before->interfaces, i, now->index);
+        if (!then || !interface_selected(now->name, interface_list)) {
+            continue;
+        }
+        char rx[32], tx[32];
+        printf("%-16s %14s %14s %10.0f %10.0f %7llu %7llu %7llu %7llu\n", now->name,
+               format_rate((double) (now->rx_bytes - then->rx_bytes) / elapsed, rx, sizeof(rx)),
+               format_rate((double) (now->tx_bytes - then->tx_bytes) / elapsed, tx, sizeof(tx)),
+               (double) (now->rx_packets - then->rx_packets) / elapsed,
+               (double) (now->tx_packets - then->tx_packets) / elapsed,
+               (unsigned long long) (now->rx_errors - then->rx_errors),
+               (unsigned long long) (now->tx_errors - then->tx_errors),
+               (unsigned long long) (now->rx_dropped - then->rx_dropped),
+               (unsigned long long) (now->tx_dropped - then->tx_dropped));
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static volatile sig_atomic_t nw_watch_stop = 0;
+
+static void nw_watch_interrupt(int signo) {
+    nw_watch_stop = 1;
+}
+
+// Parse an interval given in seconds ("0.5") or milliseconds ("100ms")
+static long parse_interval_ns(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value <= 0) {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0) {
+        return (long) (value * 1e6);
+    }
+    return *end == '\0' || strcmp(end, "s") == 0 ? (long) (value * 1e9) : -1;
+}
+
+int nw_w(char **args, int background, const FdPlan *redirects) {
+    long interval_ns = args[2] ? parse_interval_ns(args[2]) : -1;
+    long count = -1;
+    char *interface_list = NULL;
+    int valid = interval_ns > 0;
+    for (int i = 3; valid && args[i] != NULL; i += 2) {
+        if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL && (count = strtol(args[i + 1], NULL, 10)) > 0) {
+            continue;
+        } else if (strcmp(args[i], "-i") == 0 && args[i + 1] != NULL) {
+            interface_list = args[i + 1];
+        } else {
+            valid = 0;
+        }
+    }
+    if (!valid) {
+        printf("Usage: nw -w INTERVAL[ms] [-n COUNT] [-i iface,...]\n");
+        return -1;
+    }
+
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer < 0) {
+        perror("Failed to create the sampling timer");
+        return -1;
+    }
+    struct itimerspec schedule;
+    schedule.it_interval.tv_sec = interval_ns / 1000000000L;
+    schedule.it_interval.tv_nsec = interval_ns % 1000000000L;
+    schedule.it_value = schedule.it_interval;
+
+    // Two snapshots are reused for the whole run, each tick only refills one and subtracts
+    static NetSnapshot snapshots[2];
+    int current = 0;
+    if (take_net_snapshot(&snapshots[current]) < 0) {
+        perror("Failed to sample network counters");
+        close(timer);
+        return -1;
+    }
+    timerfd_settime(timer, 0, &schedule, NULL);
+
+    struct sigaction action, previous;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = nw_watch_interrupt; // no SA_RESTART, so Ctrl-C breaks out of read()
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &previous);
+    nw_watch_stop = 0;
+
+    while (!nw_watch_stop && count != 0) {
+        uint64_t expirations;
+        if (read(timer, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to wait for the sampling timer");
+            break;
+        }
+        int next = !current;
+        if (take_net_snapshot(&snapshots[next]) < 0) {
+            perror("Failed to sample network counters");
+            break;
+        }
+        print_net_rates(&snapshots[current], &snapshots[next], interface_list);
+        current = next;
+        if (count > 0) {
+            count--;
+        }
+    }
+
+    sigaction(SIGINT, &previous, NULL);
+    close(timer);
+    return 0;
+}
+
+#define BASELINE_SHM_NAME "/nw_baseline"
+#define BASELINE_MAX_INTERFACES 64
+#define BASELINE_MAX_RETRIES 100000
+
+/*
+ * Counters recorded by "nw -r", shared by every shell on the host through a
+ * POSIX shared memory segment. Writers make the sequence odd while they
+ * update the record; readers retry until they copy it under one even value.
+ * The writer also claims owner with its pid, so a writer killed mid-update
+ * leaves a dead pid behind and the next one takes the record over instead of
+ * waiting on an odd sequence forever.
+ */
+typedef struct {
+    _Atomic uint32_t sequence;
+    _Atomic pid_t owner; // pid of the writer holding the record, 0 when free
+    int valid;
+    struct timespec taken; // CLOCK_MONOTONIC, comparable across processes
+    SessionCounts sessions;
+    int interface_count;
+    InterfaceStats interfaces[BASELINE_MAX_INTERFACES];
+} NetBaseline;
+
+static int baseline_writable = 0;
+
+// Map the shared baseline, read-only when another user owns the segment
+static NetBaseline *map_baseline(void) {
+    static NetBaseline *baseline;
+    if (baseline) {
+        return baseline;
+    }
+    baseline_writable = 1;
+    int fd = shm_open(BASELINE_SHM_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == EACCES) {
+        baseline_writable = 0;
+        fd = shm_open(BASELINE_SHM_NAME, O_RDONLY | O_CLOEXEC, 0);
+    }
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (st.st_size < (off_t) sizeof(NetBaseline) &&
+                               (!baseline_writable || ftruncate(fd, sizeof(NetBaseline)) < 0))) {
+        close(fd);
+        return NULL;
+    }
+    int protection = baseline_writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *map = mmap(NULL, sizeof(NetBaseline), protection, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    baseline = map;
+    return baseline;
+}
+
+int store_baseline(const SessionCounts *sessions, const InterfaceTable *table) {
+    NetBaseline *shared = map_baseline();
+    if (!shared) {
+        return -1;
+    }
+    if (!baseline_writable) {
+        errno = EACCES;
+        return -1;
+    }
+
+    // Writers exclude each other through owner; a dead owner is taken over
+    pid_t self = getpid();
+    pid_t owner = 0;
+    for (int tries = 0;; tries++) {
+        if (atomic_compare_exchange_weak_explicit(&shared->owner, &owner, self, memory_order_acquire,
+                                                  memory_order_relaxed)) {
+            break;
+        }
+        if (owner != 0 && kill(owner, 0) < 0 && errno == ESRCH) {
+            continue; // the failed exchange left the dead pid in owner, so the next one replaces it
+        }
+        if (tries >= BASELINE_MAX_RETRIES) {
+            errno = EBUSY;
+            return -1;
+        }
+        owner = 0;
+    }
+
+    // A sequence that is already odd was left by a dead writer; its half-written record is overwritten below
+    uint32_t sequence = atomic_load_explicit(&shared->sequence, memory_order_relaxed) | 1;
+    atomic_store_explicit(&shared->sequence, sequence, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    clock_gettime(CLOCK_MONOTONIC, &shared->taken);
+    shared->sessions = *sessions;
+    shared->interface_count = table->count < BASELINE_MAX_INTERFACES ? table->count : BASELINE_MAX_INTERFACES;
+    memcpy(shared->interfaces, table->entries, shared->interface_count * sizeof(InterfaceStats));
+    shared->valid = 1;
+
+    atomic_store_explicit(&shared->sequence, sequence + 1, memory_order_release);
+    atomic_store_explicit(&shared->owner, 0, memory_order_release);
+    return 0;
+}
+
+// Copy a consistent baseline; returns 0 if one was found and -1 otherwise
+int load_baseline(NetBaseline *copy) {
+    NetBaseline *shared = map_baseline();
+    if (!shared) {
+        return -1;
+    }
+    for (int tries = 0; tries < BASELINE_MAX_RETRIES; tries++) {
+        uint32_t before = atomic_load_explicit(&shared->sequence, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        size_t skip = offsetof(NetBaseline, valid);
+        memcpy((char *) copy + skip, (char *) shared + skip, sizeof(NetBaseline) - skip);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&shared->sequence, memory_order_relaxed) == before) {
+            return copy->valid ? 0 : -1;
+        }
+    }
+    errno = EBUSY;
+    return -1;
+}
+
+static const InterfaceStats *baseline_interface(const NetBaseline *baseline, const InterfaceStats *now) {
+    for (int i = 0; i < baseline->interface_count; i++) {
+        const InterfaceStats *then = &baseline->interfaces[i];
+        if (then->index == now->index && strcmp(then->name, now->name) == 0) {
+            // A counter that went backwards means the device was recreated
+            return now->rx_bytes >= then->rx_bytes && now->tx_bytes >= then->tx_bytes ? then : NULL;
+        }
+    }
+    return NULL;
+}
+
+int display_interface_traffic(const char *interface_list, const NetBaseline *baseline, double elapsed) {
+    static InterfaceTable table;
+    static const InterfaceStats zero;
+    if (collect_interface_stats(&table) < 0) {
+        perror("Failed to read interface statistics");
+        return -1;
+    }
+
+    int shown = 0;
+    for (int i = 0; i < table.count; i++) {
+        InterfaceStats *e = &table.entries[i];
+        if (!interface_selected(e->name, interface_list)) {
+            continue;
+        }
+        const InterfaceStats *then = baseline ? baseline_interface(baseline, e) : NULL;
+        const InterfaceStats *base = then ? then : &zero;
+        char rate[32];
+        printf("Incoming traffic on %s: %llu bytes, %llu packets, %llu errors, %llu dropped", e->name,
+               (unsigned long long) (e->rx_bytes - base->rx_bytes),
+               (unsigned long long) (e->rx_packets - base->rx_packets),
+               (unsigned long long) (e->rx_errors - base->rx_errors),
+               (unsigned long long) (e->rx_dropped - base->rx_dropped));
+        if (then && elapsed > 0) {
+            printf(" (%s)", format_rate((double) (e->rx_bytes - base->rx_bytes) / elapsed, rate, sizeof(rate)));
+        }
+        printf("\nOutgoing traffic on %s: %llu bytes, %llu packets, %llu errors, %llu dropped", e->name,
+               (unsigned long long) (e->tx_bytes - base->tx_bytes),
+               (unsigned long long) (e->tx_packets - base->tx_packets),
+               (unsigned long long) (e->tx_errors - base->tx_errors),
+               (unsigned long long) (e->tx_dropped - base->tx_dropped));
+        if (then && elapsed > 0) {
+            printf(" (%s)", format_rate((double) (e->tx_bytes - base->tx_bytes) / elapsed, rate, sizeof(rate)));
+        }
+        printf("\n");
+        if (baseline && !then) {
+            printf("(%s appeared after the baseline, totals shown)\n", e->name);
+        }
+        shown++;
+    }
+    if (shown == 0 && interface_list) {
+        printf("No such interface: %s\n", interface_list);
+        return -1;
+    }
+    return 0;
+}
+
+static int nw_syscall_available = 0;
+
+/*
+ * The course kernel exposes network monitoring hooks as SYSCALL_NUMBER. On
+ * a stock kernel that number is missing or belongs to another call, so the
+ * hooks are only used when the read-only query succeeds at startup.
+ */
+void probe_nw_syscall(void) {
+    nw_syscall_available = syscall(SYSCALL_NUMBER, 4) >= 0;
+}
+
+static void nw_syscall_hook(int operation) {
+    if (nw_syscall_available) {
+        syscall(SYSCALL_NUMBER, operation);
+    }
+}
+
+int nw_m(char **args, int background, const FdPlan *redirects) {
+    char *interface_list = NULL;
+    if (args[2] != NULL) {
+        if (strcmp(args[2], "-i") != 0 || args[3] == NULL) {
+            printf("Usage: nw -m [-i iface[,iface...]]\n");
+            return -1;
+        }
+        interface_list = args[3];
+    }
+    nw_syscall_hook(4); // network data
+
+    static NetBaseline baseline;
+    int have_baseline = load_baseline(&baseline) == 0;
+    double elapsed = 0;
+    if (have_baseline) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = timespec_seconds(&baseline.taken, &now);
+    }
+    calculate_sessions(have_baseline ? &baseline.sessions : NULL);
+    display_interface_traffic(interface_list, have_baseline ? &baseline : NULL, elapsed);
+    if (have_baseline) {
+        printf("Time since baseline: %.6f seconds\n", elapsed);
+    } else {
+        printf("No baseline recorded yet, run nw -r to start measuring\n");
+    }
+    return 0;
+}
+
+int nw_r(char **args, int background, const FdPlan *redirects) {
+    static InterfaceTable table;
+    SessionCounts sessions;
+    nw_syscall_hook(3); // restarting monitoring
+    if (collect_interface_stats(&table) < 0 || count_sessions(&sessions, NULL) < 0) {
+        perror("Failed to sample network counters");
+        return -1;
+    }
+    if (store_baseline(&sessions, &table) < 0) {
+        perror("Failed to store the network baseline");
+        return -1;
+    }
+    return 0;
+}
+
+static const char *tcp_state_names[] = {
+        "UNKNOWN", "ESTABLISHED", "SYN_SENT", "SYN_RECV", "FIN_WAIT1", "FIN_WAIT2", "TIME_WAIT",
+        "CLOSE", "CLOSE_WAIT", "LAST_ACK", "LISTEN", "CLOSING", "NEW_SYN_RECV"
+};
+
+#define TCP_STATE_COUNT (sizeof(tcp_state_names) / sizeof(tcp_state_names[0]))
+
+// Socket inodes held by one process, reused while its fd directory is unchanged
+typedef struct {
+    int pid;
+    struct timespec fd_mtime;
+    off_t fd_size; // number of open fds on kernels since 6.2
+    uint32_t *inodes;
+    int inode_count;
+    int state_counts[TCP_STATE_COUNT];
+    int udp_count;
+    int total;
+} ProcSockets;
+
+typedef struct {
+    uint32_t inode;
+    int owner; // index into the ProcSockets array, -1 for an empty slot
+} InodeOwner;
+
+static ProcSockets *socket_owners;
+static int socket_owner_count;
+static InodeOwner *owner_index;
+static size_t owner_index_capacity;
+
+static int compare_proc_pid(const void *a, const void *b) {
+    return ((const ProcSockets *) a)->pid - ((const ProcSockets *) b)->pid;
+}
+
+// Collect "socket:[inode]" links from /proc/<pid>/fd with one readlinkat per entry
+static void scan_fd_directory(int proc_fd, ProcSockets *proc) {
+    char path[32];
+    snprintf(path, sizeof(path), "%d/fd", proc->pid);
+    int fd_dir = openat(proc_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd_dir >= 0 ? fdopendir(fd_dir) : NULL;
+    proc->inode_count = 0;
+    if (!dir) {
+        if (fd_dir >= 0) {
+            close(fd_dir);
+        }
+        return;
+    }
+
+    int capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char target[64];
+        ssize_t len = readlinkat(fd_dir, entry->d_name, target, sizeof(target) - 1);
+        if (len < 9 || strncmp(target, "socket:[", 8) != 0) {
+            continue;
+        }
+        target[len] = '\0';
+        if (proc->inode_count >= capacity) {
+            capacity = capacity ? 2 * capacity : 16;
+            uint32_t *inodes = realloc(proc->inodes, capacity * sizeof(uint32_t));
+            if (!inodes) {
+                break;
+            }
+            proc->inodes = inodes;
+        }
+        proc->inodes[proc->inode_count++] = (uint32_t) strtoul(target + 8, NULL, 10);
+    }
+    closedir(dir);
+}
+
+static InodeOwner *owner_slot(uint32_t inode) {
+    size_t mask = owner_index_capacity - 1;
+    size_t i = (inode * 2654435761U) & mask;
+    while (owner_index[i].owner >= 0 && owner_index[i].inode != inode) {
+        i = (i + 1) & mask;
+    }
+    return &owner_index[i];
+}
+
+/*
+ * Bring the inode -> process index up to date. Processes whose fd directory
+ * still has the same mtime and size keep their cached inodes; new ones are
+ * walked and vanished ones dropped. With full set every process is walked.
+ *
+ * The skip is only a hint: procfs does not update the mtime of
+ * /proc/<pid>/fd when fds come and go, and its size is the fd count only
+ * since Linux 6.2, so a process that swapped one socket for another keeps
+ * stale inodes. nw_p() catches that through sockets it cannot place.
+ */
+int refresh_socket_owners(int full) {
+    int proc_fd = open(proc_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = proc_fd >= 0 ? fdopendir(proc_fd) : NULL;
+    if (!dir) {
+        perror("Failed to open /proc");
+        if (proc_fd >= 0) {
+            close(proc_fd);
+        }
+        return -1;
+    }
+
+    ProcSockets *fresh = NULL;
+    int count = 0, capacity = 0;
+    size_t total_inodes = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!isdigit((unsigned char) entry->d_name[0])) {
+            continue;
+        }
+        if (count >= capacity) {
+            capacity = capacity ? 2 * capacity : 256;
+            ProcSockets *grown = realloc(fresh, capacity * sizeof(ProcSockets));
+            if (!grown) {
+                break;
+            }
+            fresh = grown;
+        }
+        ProcSockets *proc = &fresh[count];
+        memset(proc, 0, sizeof(*proc));
+        proc->pid = atoi(entry->d_name);
+
+        char path[32];
+        struct stat st;
+        snprintf(path, sizeof(path), "%d/fd", proc->pid);
+        if (fstatat(proc_fd, path, &st, 0) < 0) {
+            continue; // the process exited
+        }
+        ProcSockets key = {.pid = proc->pid};
+        ProcSockets *cached = socket_owners ? bsearch(&key, socket_owners, socket_owner_count,
+                                                      sizeof(ProcSockets), compare_proc_pid) : NULL;
+        if (cached && !full && cached->fd_size == st.st_size && cached->fd_mtime.tv_sec == st.st_mtim.tv_sec &&
+            cached->fd_mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            proc->inodes = cached->inodes;
+            proc->inode_count = cached->inode_count;
+        } else {
+            if (cached) {
+                proc->inodes = cached->inodes; // reuse the allocation
+            }
+            scan_fd_directory(proc_fd, proc);
+        }
+        proc->fd_mtime = st.st_mtim;
+        proc->fd_size = st.st_size;
+        if (cached) {
+            cached->inodes = NULL; // ownership moved to the fresh entry
+        }
+        total_inodes += proc->inode_count;
+        count++;
+    }
+    closedir(dir);
+
+    for (int i = 0; i < socket_owner_count; i++) {
+        free(socket_owners[i].inodes);
+    }
+    free(socket_owners);
+    socket_owners = fresh;
+    socket_owner_count = count;
+    qsort(socket_owners, socket_owner_count, sizeof(ProcSockets), compare_proc_pid);
+
+    size_t needed = 64;
+    while (needed < 2 * total_inodes) {
+        needed *= 2;
+    }
+    if (needed != owner_index_capacity) {
+        InodeOwner *table = realloc(owner_index, needed * sizeof(InodeOwner));
+        if (!table) {
+            return -1;
+        }
+        owner_index = table;
+        owner_index_capacity = needed;
+    }
+    for (size_t i = 0; i < owner_index_capacity; i++) {
+        owner_index[i].owner = -1;
+    }
+    for (int p = 0; p < socket_owner_count; p++) {
+        for (int i = 0; i < socket_owners[p].inode_count; i++) {
+            InodeOwner *slot = owner_slot(socket_owners[p].inodes[i]);
+            if (slot->owner < 0) { // a socket shared after fork is credited to the lowest pid
+                slot->inode = socket_owners[p].inodes[i];
+                slot->owner = p;
+            }
+        }
+    }
+    return 0;
+}
+
+// Socket inodes found in the socket table but in no process's fd directory
+typedef struct {
+    uint32_t *inodes;
+    int count;
+    int capacity;
+} InodeList;
+
+/* unowned after the last full walk: kernel sockets and processes we may not read */
+static InodeList unowned_inodes;
+
+static int compare_inodes(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void count_owned_socket(const SocketInfo *sock, void *ctx) {
+    if (sock->inode == 0) {
+        return;
+    }
+    InodeOwner *slot = owner_slot(sock->inode);
+    if (slot->owner < 0) {
+        InodeList *unknown = ctx;
+        if (unknown->count >= unknown->capacity) {
+            int capacity = unknown->capacity ? 2 * unknown->capacity : 64;
+            uint32_t *grown = realloc(unknown->inodes, capacity * sizeof(uint32_t));
+            if (!grown) {
+                return;
+            }
+            unknown->inodes = grown;
+            unknown->capacity = capacity;
+        }
+        unknown->inodes[unknown->count++] = sock->inode;
+        return;
+    }
+    ProcSockets *proc = &socket_owners[slot->owner];
+    if (sock->protocol == IPPROTO_UDP) {
+        proc->udp_count++;
+    } else if (sock->state > 0 && sock->state < (int) TCP_STATE_COUNT) {
+        proc->state_counts[sock->state]++;
+    }
+    proc->total++;
+}
+
+static int compare_socket_total(const void *a, const void *b) {
+    const ProcSockets *p1 = *(ProcSockets *const *) a;
+    const ProcSockets *p2 = *(ProcSockets *const *) b;
+    return p2->total != p1->total ? p2->total - p1->total : p1->pid - p2->pid; // Descending order
+}
+
+// Credit every TCP and UDP socket to its owner, listing the inodes nobody owns in unknown
+static int count_socket_owners(InodeList *unknown) {
+    for (int i = 0; i < socket_owner_count; i++) {
+        ProcSockets *proc = &socket_owners[i];
+        memset(proc->state_counts, 0, sizeof(proc->state_counts));
+        proc->udp_count = proc->total = 0;
+    }
+    unknown->count = 0;
+    if (enumerate_sockets(IPPROTO_TCP, SOCK_STATES_ALL, count_owned_socket, unknown) < 0 ||
+        enumerate_sockets(IPPROTO_UDP, SOCK_STATES_ALL, count_owned_socket, unknown) < 0) {
+        perror("Failed to read the socket table");
+        return -1;
+    }
+    return 0;
+}
+
+int nw_p(char **args, int background, const FdPlan *redirects) {
+    int full = args[2] != NULL && strcmp(args[2], "--full") == 0;
+    if (args[2] != NULL && !full) {
+        printf("Usage: nw -p [--full]\n");
+        return -1;
+    }
+    static InodeList unknown;
+    full |= socket_owners == NULL; /* the first walk reads everything anyway */
+    if (refresh_socket_owners(full) < 0 || count_socket_owners(&unknown) < 0) {
+        return -1;
+    }
+    for (int i = 0; !full && i < unknown.count; i++) {
+        if (!unowned_inodes.count || !bsearch(&unknown.inodes[i], unowned_inodes.inodes, unowned_inodes.count,
+                                              sizeof(uint32_t), compare_inodes)) {
+            /* a socket no cached process explains: some fd directory changed unseen */
+            full = 1;
+            if (refresh_socket_owners(1) < 0 || count_socket_owners(&unknown) < 0) {
+                return -1;
+            }
+        }
+    }
+    if (full) {
+        InodeList swap = unowned_inodes;
+        unowned_inodes = unknown;
+        unknown = swap;
+        qsort(unowned_inodes.inodes, unowned_inodes.count, sizeof(uint32_t), compare_inodes);
+    }
+
+    ProcSockets **owners = malloc((socket_owner_count + 1) * sizeof(ProcSockets *));
+    if (!owners) {
+        fprintf(stderr, "allocation error in nw_p: owners\n");
+        return -1;
+    }
+    int count = 0;
+    for (int i = 0; i < socket_owner_count; i++) {
+        if (socket_owners[i].total > 0) {
+            owners[count++] = &socket_owners[i];
+        }
+    }
+    qsort(owners, count, sizeof(ProcSockets *), compare_socket_total);
+
+    printf("PID\tCommand\t\tSockets\tStates\n");
+    for (int i = 0; i < count; i++) {
+        ProcSockets *proc = owners[i];
+        char path[256], comm[32] = "?";
+        snprintf(path, sizeof(path), "%s/%d/comm", proc_root, proc->pid);
+        FILE *fp = fopen(path, "r");
+        if (fp) {
+            if (fgets(comm, sizeof(comm), fp)) {
+                comm[strcspn(comm, "\n")] = '\0';
+            }
+            fclose(fp);
+        }
+        printf("%d\t%-15s\t%d\t", proc->pid, comm, proc->total);
+        for (size_t s = 1; s < TCP_STATE_COUNT; s++) {
+            if (proc->state_counts[s]) {
+                printf("%s:%d ", tcp_state_names[s], proc->state_counts[s]);
+            }
+        }
+        if (proc->udp_count) {
+            printf("UDP:%d", proc->udp_count);
+        }
+        printf("\n");
+    }
+    free(owners);
+    return 0;
+}
+
+#define NW_TOP_DEFAULT 10
+
+typedef struct {
+    unsigned char addr[16];
+    uint16_t port;
+    uint8_t family; // 0 marks an empty slot
+    int total;
+    int states[TCP_STATE_COUNT];
+} ConnAggregate;
+
+typedef struct {
+    ConnAggregate *slots;
+    size_t count;
+    size_t capacity; // power of two
+} AggregateTable;
+
+typedef struct {
+    AggregateTable ports;
+    AggregateTable peers;
+    int states[TCP_STATE_COUNT];
+    int total;
+} ConnReport;
+
+static ConnAggregate *aggregate_find(ConnAggregate *slots, size_t capacity, int family, const unsigned char *addr,
+                                     uint16_t port) {
+    size_t mask = capacity - 1;
+    size_t i = listen_addr_hash(addr, port, mask);
+    while (slots[i].family && (slots[i].family != family || slots[i].port != port ||
+                               memcmp(slots[i].addr, addr, 16) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+static ConnAggregate *aggregate_get(AggregateTable *table, int family, const unsigned char *addr, uint16_t port) {
+    if (2 * (table->count + 1) > table->capacity) {
+        size_t capacity = table->capacity ? 2 * table->capacity : 1024;
+        ConnAggregate *slots = calloc(capacity, sizeof(ConnAggregate));
+        if (!slots) {
+            return NULL;
+        }
+        for (size_t i = 0; i < table->capacity; i++) {
+            ConnAggregate *old = &table->slots[i];
+            if (old->family) {
+                *aggregate_find(slots, capacity, old->family, old->addr, old->port) = *old;
+            }
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->capacity = capacity;
+    }
+    ConnAggregate *slot = aggregate_find(table->slots, table->capacity, family, addr, port);
+    if (!slot->family) {
+        slot->family = (uint8_t) family;
+        memcpy(slot->addr, addr, 16);
+        slot->port = port;
+        table->count++;
+    }
+    return slot;
+}
+
+static void aggregate_reset(AggregateTable *table) {
+    if (table->slots) {
+        memset(table->slots, 0, table->capacity * sizeof(ConnAggregate));
+    }
+    table->count = 0;
+}
+
+static void aggregate_connection(const SocketInfo *sock, void *ctx) {
+    static const unsigned char any[16];
+    ConnReport *report = ctx;
+    int state = sock->state > 0 && sock->state < (int) TCP_STATE_COUNT ? sock->state : 0;
+    report->states[state]++;
+    report->total++;
+    if (sock->state == TCP_LISTEN) {
+        return;
+    }
+    ConnAggregate *port = aggregate_get(&report->ports, AF_INET, any, sock->local_port);
+    ConnAggregate *peer = aggregate_get(&report->peers, sock->family, sock->remote_addr, 0);
+    if (port) {
+        port->total++;
+        port->states[state]++;
+    }
+    if (peer) {
+        peer->total++;
+        peer->states[state]++;
+    }
+}
+
+// Keep the n largest aggregates in a min-heap, so a report costs O(entries * log n)
+static int select_top(const AggregateTable *table, ConnAggregate **heap, int n) {
+    int size = 0;
+    for (size_t i = 0; i < table->capacity; i++) {
+        ConnAggregate *entry = &table->slots[i];
+        if (!entry->family || (size == n && entry->total <= heap[0]->total)) {
+            continue;
+        }
+        int pos;
+        if (size < n) {
+            pos = size++;
+            while (pos > 0 && heap[(pos - 1) / 2]->total > entry->total) {
+                heap[pos] = heap[(pos - 1) / 2];
+                pos = (pos - 1) / 2;
+            }
+        } else {
+            pos = 0;
+            for (;;) {
+                int child = 2 * pos + 1;
+                if (child >= size) {
+                    break;
+                }
+                if (child + 1 < size && heap[child + 1]->total < heap[child]->total) {
+                    child++;
+                }
+                if (heap[child]->total >= entry->total) {
+                    break;
+                }
+                heap[pos] = heap[child];
+                pos = child;
+            }
+        }
+        heap[pos] = entry;
+    }
+    for (int i = 1; i < size; i++) { // order the heap for printing, it holds at most n entries
+        ConnAggregate *entry = heap[i];
+        int j = i;
+        for (; j > 0 && heap[j - 1]->total < entry->total; j--) {
+            heap[j] = heap[j - 1];
+        }
+        heap[j] = entry;
+    }
+    return size;
+}
+
+static void print_aggregate_row(const char *key, const ConnAggregate *entry) {
+    int other = entry->total - entry->states[TCP_ESTABLISHED] - entry->states[TCP_TIME_WAIT] -
+                entry->states[TCP_CLOSE_WAIT];
+    printf("%-40s %8d %12d %10d %11d %8d\n", key, entry->total, entry->states[TCP_ESTABLISHED],
+           entry->states[TCP_TIME_WAIT], entry->states[TCP_CLOSE_WAIT], other);
+}
+
+int nw_s(char **args, int background, const FdPlan *redirects) {
+    int top = NW_TOP_DEFAULT;
+    if (args[2] != NULL) {
+        if (strcmp(args[2], "-n") != 0 || args[3] == NULL || (top = atoi(args[3])) <= 0) {
+            printf("Usage: nw -s [-n TOP]\n");
+            return -1;
+        }
+    }
+
+    static ConnReport report;
+    aggregate_reset(&report.ports);
+    aggregate_reset(&report.peers);
+    memset(report.states, 0, sizeof(report.states));
+    report.total = 0;
+    if (enumerate_sockets(IPPROTO_TCP, SOCK_STATES_ALL, aggregate_connection, &report) < 0) {
+        perror("Failed to read the socket table");
+        return -1;
+    }
+
+    printf("TCP sockets: %d\n", report.total);
+    for (size_t s = 1; s < TCP_STATE_COUNT; s++) {
+        if (report.states[s]) {
+            printf("  %-12s %d\n", tcp_state_names[s], report.states[s]);
+        }
+    }
+
+    ConnAggregate **heap = malloc(top * sizeof(ConnAggregate *));
+    if (!heap) {
+        fprintf(stderr, "allocation error in nw_s: heap\n");
+        return -1;
+    }
+    const char *header = "%-40s %8s %12s %10s %11s %8s\n";
+    int count = select_top(&report.ports, heap, top);
+    printf("\nTop local ports:\n");
+    printf(header, "Port", "Total", "ESTABLISHED", "TIME_WAIT", "CLOSE_WAIT", "Other");
+    for (int i = 0; i < count; i++) {
+        char key[8];
+        snprintf(key, sizeof(key), "%u", heap[i]->port);
+        print_aggregate_row(key, heap[i]);
+    }
+
+    count = select_top(&report.peers, heap, top);
+    printf("\nTop peers:\n");
+    printf(header, "Address", "Total", "ESTABLISHED", "TIME_WAIT", "CLOSE_WAIT", "Other");
+    for (int i = 0; i < count; i++) {
+        char key[INET6_ADDRSTRLEN];
+        inet_ntop(heap[i]->family, heap[i]->addr, key, sizeof(key));
+        print_aggregate_row(key, heap[i]);
+    }
+    free(heap);
+    return 0;
+}
+
+#define PROBE_TIMEOUT_NS 5000000000ULL
+
+// Split "host:port" or "[v6addr]:port" in place
+static int split_host_port(char *target, char **host, char **port) {
+    char *colon = strrchr(target, ':');
+    if (!colon || colon == target || colon[1] == '\0') {
+        return -1;
+    }
+    *colon = '\0';
+    *port = colon + 1;
+    *host = target;
+    if (target[0] == '[' && colon[-1] == ']') {
+        colon[-1] = '\0';
+        *host = target + 1;
+    }
+    return 0;
+}
+
+/*
+ * Open count non-blocking TCP connections to the target with at most
+ * parallel in flight, all completions driven by one epoll loop, and
+ * record each connect latency.
+ */
+int probe_connect_latency(const struct addrinfo *target, int count, int parallel, LatencyHistogram *histogram,
+                          int *failed, int *first_error) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int *fds = malloc(parallel * sizeof(int));
+    uint64_t *started = malloc(parallel * sizeof(uint64_t));
+    if (epoll_fd < 0 || !fds || !started) {
+        if (epoll_fd >= 0) {
+            close(epoll_fd);
+        }
+        free(fds);
+        free(started);
+        return -1;
+    }
+
+    int launched = 0, finished = 0, in_flight = 0;
+    for (int i = 0; i < parallel; i++) {
+        fds[i] = -1;
+    }
+    *failed = 0;
+    *first_error = 0;
+    while (finished < count) {
+        // Fill every free slot before waiting
+        for (int slot = 0; slot < parallel && launched < count; slot++) {
+            if (fds[slot] >= 0) {
+                continue;
+            }
+            launched++;
+            int fd = socket(target->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            started[slot] = monotonic_ns();
+            if (fd < 0 || (connect(fd, target->ai_addr, target->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+                *first_error = *first_error ? *first_error : errno;
+                (*failed)++;
+                finished++;
+                if (fd >= 0) {
+                    close(fd);
+                }
+                continue;
+            }
+            struct epoll_event event = {.events = EPOLLOUT, .data.u32 = (uint32_t) slot};
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+            fds[slot] = fd;
+            in_flight++;
+        }
+        if (in_flight == 0) {
+            continue;
+        }
+
+        struct epoll_event events[64];
+        int ready = epoll_wait(epoll_fd, events, 64, 100);
+        uint64_t now = monotonic_ns();
+        for (int i = 0; i < ready; i++) {
+            int slot = (int) events[i].data.u32;
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(fds[slot], SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error == 0) {
+                histogram_record(histogram, now - started[slot]);
+            } else {
+                *first_error = *first_error ? *first_error : error;
+                (*failed)++;
+            }
+            close(fds[slot]); // closing also removes it from the epoll set
+            fds[slot] = -1;
+            in_flight--;
+            finished++;
+        }
+        for (int slot = 0; slot < parallel; slot++) {
+            if (fds[slot] >= 0 && now - started[slot] > PROBE_TIMEOUT_NS) {
+                *first_error = *first_error ? *first_error : ETIMEDOUT;
+                (*failed)++;
+                close(fds[slot]);
+                fds[slot] = -1;
+                in_flight--;
+                finished++;
+            }
+        }
+    }
+
+    close(epoll_fd);
+    free(fds);
+    free(started);
+    return 0;
+}
+
+int nw_l(char **args, int background, const FdPlan *redirects) {
+    int count = 10, parallel = 1;
+    int valid = args[2] != NULL;
+    for (int i = 3; valid && args[i] != NULL; i += 2) {
+        if (strcmp(args[i], "-c") == 0 && args[i + 1] != NULL) {
+            count = atoi(args[i + 1]);
+        } else if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL) {
+            parallel = atoi(args[i + 1]);
+        } else {
+            valid = 0;
+        }
+    }
+    char target[256], *host, *port;
+    if (valid) {
+        snprintf(target, sizeof(target), "%s", args[2]);
+    }
+    if (!valid || count <= 0 || parallel <= 0 || split_host_port(target, &host, &port) < 0) {
+        printf("Usage: nw -l host:port [-c COUNT] [-j PARALLEL]\n");
+        return -1;
+    }
+    parallel = parallel < count ? parallel : count;
+
+    struct addrinfo hints, *resolved;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(host, port, &hints, &resolved);
+    if (error != 0) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", args[2], gai_strerror(error));
+        return -1;
+    }
+
+    static LatencyHistogram histogram;
+    memset(&histogram, 0, sizeof(histogram));
+    int failed, first_error;
+    uint64_t begin = monotonic_ns();
+    int result = probe_connect_latency(resolved, count, parallel, &histogram, &failed, &first_error);
+    uint64_t elapsed = monotonic_ns() - begin;
+    freeaddrinfo(resolved);
+    if (result < 0) {
+        perror("Failed to start the connect probe");
+        return -1;
+    }
+
+    printf("Connected %llu/%d to %s in %.3f s, %d in flight", (unsigned long long) histogram.count, count, args[2],
+           (double) elapsed / 1e9, parallel);
+    if (failed) {
+        printf(", %d failed (%s)", failed, strerror(first_error));
+    }
+    printf("\n");
+    if (histogram.count) {
+        printf("Connect latency (us): min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f\n", histogram.min / 1e3,
+               (double) histogram.sum / (double) histogram.count / 1e3, histogram_percentile(&histogram, 50) / 1e3,
+               histogram_percentile(&histogram, 99) / 1e3, histogram.max / 1e3);
+    }
+    return failed ? -1 : 0;
+}
+
+#define BENCH_DEFAULT_SIZE (128 * 1024)
+
+enum {
+    BENCH_SEND, BENCH_SENDFILE, BENCH_SPLICE, BENCH_ZEROCOPY, BENCH_MODES
+};
+
+static const char *bench_mode_names[] = {"send", "sendfile", "splice", "zerocopy"};
+
+typedef struct {
+    uint64_t bytes;
+    uint64_t syscalls;
+} BenchCounters;
+
+// Receiving end, run in a forked child: drain the socket and report back through a pipe
+static void bench_receiver(int sock, size_t size, int report_fd) {
+    BenchCounters counters = {0, 0};
+    char *buffer = malloc(size);
+    ssize_t n;
+    while (buffer && (n = recv(sock, buffer, size, 0)) != 0) {
+        counters.syscalls++;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        counters.bytes += (uint64_t) n;
+    }
+    write(report_fd, &counters, sizeof(counters));
+    _exit(0);
+}
+
+// Drain MSG_ZEROCOPY completions, otherwise the socket runs out of option memory
+static uint64_t reap_zerocopy_completions(int sock) {
+    uint64_t calls = 0;
+    char control[128];
+    for (;;) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        calls++;
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return calls;
+        }
+    }
+}
+
+/*
+ * Push data through sock with one transmit path until the deadline passes.
+ * Returns the number of bytes the sender handed to the kernel, or -1.
+ */
+static int64_t bench_send_loop(int mode, int sock, char *buffer, size_t size, int source_fd, int pipe_fds[2],
+                               uint64_t deadline, uint64_t *syscalls) {
+    int64_t sent = 0;
+    while (monotonic_ns() < deadline) {
+        ssize_t n;
+        if (mode == BENCH_SEND) {
+            n = send(sock, buffer, size, MSG_NOSIGNAL);
+            (*syscalls)++;
+        } else if (mode == BENCH_SENDFILE) {
+            off_t offset = 0;
+            n = sendfile(sock, source_fd, &offset, size);
+            (*syscalls)++;
+        } else if (mode == BENCH_SPLICE) {
+            struct iovec iov = {.iov_base = buffer, .iov_len = size};
+            n = vmsplice(pipe_fds[1], &iov, 1, 0);
+            (*syscalls)++;
+            for (ssize_t moved = 0, m; n > 0 && moved < n; moved += m) {
+                m = splice(pipe_fds[0], NULL, sock, NULL, (size_t) (n - moved), SPLICE_F_MOVE | SPLICE_F_MORE);
+                (*syscalls)++;
+                if (m <= 0) {
+                    return -1;
+                }
+            }
+        } else {
+            n = send(sock, buffer, size, MSG_ZEROCOPY | MSG_NOSIGNAL);
+            (*syscalls)++;
+            if (n < 0 && errno == ENOBUFS) {
+                struct pollfd pfd = {.fd = sock, .events = 0};
+                poll(&pfd, 1, 10); // POLLERR is raised once completions are queued
+                *syscalls += 1 + reap_zerocopy_completions(sock);
+                continue;
+            }
+            if ((*syscalls & 63) == 0) {
+                *syscalls += reap_zerocopy_completions(sock);
+            }
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+// Connected stream pair over 127.0.0.1, or a Unix socketpair
+static int bench_connect_pair(int use_unix, int pair[2]) {
+    if (use_unix) {
+        return socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair);
+    }
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listener, 1) < 0 ||
+        getsockname(listener, (struct sockaddr *) &addr, &len) < 0) {
+        if (listener >= 0) {
+            close(listener);
+        }
+        return -1;
+    }
+    pair[0] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (pair[0] < 0 || connect(pair[0], (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        (pair[1] = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+        if (pair[0] >= 0) {
+            close(pair[0]);
+        }
+        close(listener);
+        return -1;
+    }
+    close(listener);
+    return 0;
+}
+
+static double rusage_seconds(const struct rusage *usage) {
+    return (double) (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) +
+           (double) (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) / 1e6;
+}
+
+static int bench_run_mode(int mode, int use_unix, char *buffer, size_t size, int source_fd, double duration) {
+    int pair[2], report[2], pipe_fds[2] = {-1, -1};
+    if (bench_connect_pair(use_unix, pair) < 0) {
+        perror("Failed to connect the benchmark sockets");
+        return -1;
+    }
+    if (mode == BENCH_ZEROCOPY) {
+        int one = 1;
+        if (setsockopt(pair[0], SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+            printf("%-10s not supported on this socket (%s)\n", bench_mode_names[mode], strerror(errno));
+            close(pair[0]);
+            close(pair[1]);
+            return 0;
+        }
+    }
+    if (mode == BENCH_SPLICE) {
+        if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+            perror("Failed to create the splice pipe");
+            close(pair[0]);
+            close(pair[1]);
+            return -1;
+        }
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, (int) size);
+    }
+    if (pipe2(report, O_CLOEXEC) < 0) {
+        perror("Failed to create the report pipe");
+        close(pair[0]);
+        close(pair[1]);
+        if (pipe_fds[0] >= 0) {
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+        }
+        return -1;
+    }
+
+    pid_t receiver = fork();
+    if (receiver == 0) {
+        close(pair[0]);
+        close(report[0]);
+        bench_receiver(pair[1], size, report[1]);
+    }
+    close(pair[1]);
+    close(report[1]);
+    if (receiver < 0) {
+        perror("error in nw -b: forking");
+        close(pair[0]);
+        close(report[0]);
+        return -1;
+    }
+
+    struct rusage before, after, receiver_usage;
+    uint64_t syscalls = 0;
+    getrusage(RUSAGE_SELF, &before);
+    uint64_t begin = monotonic_ns();
+    int64_t sent = bench_send_loop(mode, pair[0], buffer, size, source_fd, pipe_fds,
+                                   begin + (uint64_t) (duration * 1e9), &syscalls);
+    shutdown(pair[0], SHUT_WR);
+    if (mode == BENCH_ZEROCOPY) {
+        syscalls += reap_zerocopy_completions(pair[0]);
+    }
+    getrusage(RUSAGE_SELF, &after);
+
+    BenchCounters received = {0, 0};
+    read(report[0], &received, sizeof(received));
+    int status;
+    wait4(receiver, &status, 0, &receiver_usage);
+    uint64_t elapsed = monotonic_ns() - begin;
+    close(pair[0]);
+    close(report[0]);
+    if (pipe_fds[0] >= 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    if (sent < 0) {
+        printf("%-10s failed: %s\n", bench_mode_names[mode], strerror(errno));
+        return -1;
+    }
+
+    double gigabytes = (double) received.bytes / 1e9;
+    double send_cpu = rusage_seconds(&after) - rusage_seconds(&before);
+    double syscalls_per_gb = gigabytes > 0 ? (double) (syscalls + received.syscalls) / gigabytes : 0;
+    printf("%-10s %10.2f %14.0f %12.3f %12.3f\n", bench_mode_names[mode], (double) received.bytes * 8 / (double) elapsed,
+           syscalls_per_gb, send_cpu, rusage_seconds(&receiver_usage));
+    return 0;
+}
+
+// Parse a byte count with an optional K, M or G suffix
+static long parse_size(const char *text) {
+    char *end;
+    long value = strtol(text, &end, 10);
+    int shift = 0;
+    if (*end == 'K' || *end == 'k') {
+        shift = 10;
+    } else if (*end == 'M' || *end == 'm') {
+        shift = 20;
+    } else if (*end == 'G' || *end == 'g') {
+        shift = 30;
+    }
+    if (value <= 0 || end == text || (shift && end[1] != '\0') || (!shift && *end != '\0')) {
+        return -1;
+    }
+    return value << shift;
+}
+
+int nw_b(char **args, int background, const FdPlan *redirects) {
+    int zerocopy = 0, use_unix = 0, valid = 1;
+    long size = BENCH_DEFAULT_SIZE;
+    double duration = 1;
+    for (int i = 2; valid && args[i] != NULL; i++) {
+        if (strcmp(args[i], "--zerocopy") == 0) {
+            zerocopy = 1;
+        } else if (strcmp(args[i], "--unix") == 0) {
+            use_unix = 1;
+        } else if (strcmp(args[i], "--size") == 0 && args[i + 1] != NULL) {
+            valid = (size = parse_size(args[++i])) > 0;
+        } else if (strcmp(args[i], "--duration") == 0 && args[i + 1] != NULL) {
+            valid = (duration = strtod(args[++i], NULL)) > 0;
+        } else {
+            valid = 0;
+        }
+    }
+    if (!valid) {
+        printf("Usage: nw -b [--zerocopy] [--unix] [--size N[K|M]] [--duration S]\n");
+        return -1;
+    }
+
+    char *buffer = malloc(size);
+    int source_fd = memfd_create("nw-bench", MFD_CLOEXEC);
+    if (!buffer || source_fd < 0 || ftruncate(source_fd, size) < 0) {
+        perror("Failed to prepare the benchmark buffers");
+        free(buffer);
+        if (source_fd >= 0) {
+            close(source_fd);
+        }
+        return -1;
+    }
+    memset(buffer, 'x', size);
+    pwrite(source_fd, buffer, size, 0);
+
+    printf("Loopback throughput over %s, %ld-byte writes, %.1f s per mode\n",
+           use_unix ? "a Unix socketpair" : "TCP 127.0.0.1", size, duration);
+    printf("%-10s %10s %14s %12s %12s\n", "Mode", "Gb/s", "Syscalls/GB", "Send CPU s", "Recv CPU s");
+    fflush(stdout);
+    for (int mode = 0; mode < BENCH_MODES; mode++) {
+        if (mode == BENCH_ZEROCOPY && !zerocopy) {
+            continue;
+        }
+        bench_run_mode(mode, use_unix, buffer, (size_t) size, source_fd, duration);
+        fflush(stdout);
+    }
+    free(buffer);
+    close(source_fd);
+    return 0;
+}
+
+#define LINK_WAIT_DEFAULT_MS 5000
+
+#ifndef IFF_LOWER_UP
+#define IFF_LOWER_UP 0x10000 // from <linux/if.h>, which clashes with <net/if.h>
+#endif
+
+// The carrier is confirmed once the link is down, or up with IFF_LOWER_UP set
+static int link_state_reached(const struct ifinfomsg *ifi, int up) {
+    return up ? (ifi->ifi_flags & IFF_UP) && (ifi->ifi_flags & IFF_LOWER_UP) : !(ifi->ifi_flags & IFF_UP);
+}
+
+static int set_link_flags_ioctl(const char *name, int up) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct ifreq request;
+    memset(&request, 0, sizeof(request));
+    snprintf(request.ifr_name, sizeof(request.ifr_name), "%s", name);
+    int result = ioctl(fd, SIOCGIFFLAGS, &request);
+    if (result == 0) {
+        request.ifr_flags = up ? request.ifr_flags | IFF_UP : request.ifr_flags & ~IFF_UP;
+        result = ioctl(fd, SIOCSIFFLAGS, &request);
+    }
+    close(fd);
+    return result;
+}
+
+/*
+ * Bring a link up or down with RTM_NEWLINK. With wait_ms > 0 the socket is
+ * subscribed to link notifications first, so the carrier change can be
+ * timed until the kernel reports it; *elapsed_ms is only set then. Returns
+ * 0 once the change is confirmed (or applied, without waiting), 1 on
+ * timeout and -1 on error.
+ */
+int set_link_state(const char *name, int up, int wait_ms, double *elapsed_ms) {
+    int ifindex = (int) if_nametoindex(name);
+    if (ifindex == 0) {
+        return -1;
+    }
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        return set_link_flags_ioctl(name, up);
+    }
+    struct sockaddr_nl local = {.nl_family = AF_NETLINK, .nl_groups = wait_ms > 0 ? RTMGRP_LINK : 0};
+    if (bind(fd, (struct sockaddr *) &local, sizeof(local)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct {
+        struct nlmsghdr nlh;
+        struct ifinfomsg ifi;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.nlh.nlmsg_len = sizeof(request);
+    request.nlh.nlmsg_type = RTM_NEWLINK;
+    request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    request.nlh.nlmsg_seq = 1;
+    request.ifi.ifi_family = AF_UNSPEC;
+    request.ifi.ifi_index = ifindex;
+    request.ifi.ifi_flags = up ? IFF_UP : 0;
+    request.ifi.ifi_change = IFF_UP;
+
+    struct timespec begin, now;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    struct sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+    if (sendto(fd, &request, sizeof(request), 0, (struct sockaddr *) &kernel, sizeof(kernel)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    int acked = 0, reached = 0, queried = 0;
+    for (;;) {
+        if (acked && (reached || wait_ms <= 0)) {
+            break;
+        }
+        if (acked && !queried) {
+            // The link may already have been in the requested state, which produces no event
+            request.nlh.nlmsg_type = RTM_GETLINK;
+            request.nlh.nlmsg_flags = NLM_F_REQUEST;
+            request.nlh.nlmsg_seq = 2;
+            request.ifi.ifi_flags = request.ifi.ifi_change = 0;
+            sendto(fd, &request, sizeof(request), 0, (struct sockaddr *) &kernel, sizeof(kernel));
+            queried = 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int remaining = acked ? wait_ms - (int) (timespec_seconds(&begin, &now) * 1000) : LINK_WAIT_DEFAULT_MS;
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (remaining <= 0 || poll(&pfd, 1, remaining) <= 0) {
+            break;
+        }
+        ssize_t len = recv(fd, netlink_buffer, sizeof(netlink_buffer), 0);
+        if (len < 0) {
+            continue;
+        }
+        for (struct nlmsghdr *nlh = (struct nlmsghdr *) netlink_buffer; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type == NLMSG_ERROR && nlh->nlmsg_seq == 1) {
+                struct nlmsgerr *err = NLMSG_DATA(nlh);
+                if (err->error != 0) {
+                    close(fd);
+                    errno = -err->error;
+                    return -1;
+                }
+                acked = 1;
+            } else if (nlh->nlmsg_type == RTM_NEWLINK) {
+                struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+                if (ifi->ifi_index == ifindex && link_state_reached(ifi, up) && !reached) {
+                    // Stamped on arrival, which can be before the ack
+                    clock_gettime(CLOCK_MONOTONIC, &now);
+                    *elapsed_ms = timespec_seconds(&begin, &now) * 1000;
+                    reached = 1;
+                }
+            }
+        }
+    }
+    close(fd);
+    if (!acked) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return wait_ms > 0 && !reached ? 1 : 0;
+}
+
+static int nw_link(char **args, int up) {
+    int wait_ms = 0;
+    if (args[2] == NULL || (args[3] != NULL && strcmp(args[3], "--wait") != 0)) {
+        printf("Usage: nw %s IFACE [--wait [MS]]\n", up ? "-c" : "-d");
+        return -1;
+    }
+    if (args[3] != NULL) {
+        wait_ms = args[4] ? atoi(args[4]) : LINK_WAIT_DEFAULT_MS;
+    }
+
+    double elapsed_ms = 0;
+    int result = set_link_state(args[2], up, wait_ms, &elapsed_ms);
+    if (result < 0) {
+        fprintf(stderr, "Failed to bring %s %s: %s\n", args[2], up ? "up" : "down", strerror(errno));
+        return -1;
+    }
+    if (wait_ms <= 0) {
+        printf("Interface %s set %s\n", args[2], up ? "up" : "down");
+    } else if (result == 0) {
+        printf("Interface %s is %s, carrier change confirmed after %.3f ms\n", args[2], up ? "up" : "down",
+               elapsed_ms);
+    } else {
+        printf("Interface %s set %s, no carrier change within %d ms\n", args[2], up ? "up" : "down", wait_ms);
+    }
+    return 0;
+}
+
+int nw_d(char **args, int background, const FdPlan *redirects) {
+    nw_syscall_hook(1); // stopping connection
+    return nw_link(args, 0);
+}
+
+int nw_c(char **args, int background, const FdPlan *redirects) {
+    nw_syscall_hook(2); // starting connection
+    return nw_link(args, 1);
+}
+
+int nw_handler(char **args, int background, const FdPlan *redirects) {
+    if (args[1] == NULL) {
+        printf("Usage: nw -m [-i iface,...] | -w INTERVAL [-n COUNT] | -p | -s [-n TOP] | -l host:port [-c N] [-j P] | -b [--zerocopy] | -r | -d IFACE | -c IFACE\n");
+        return -1;
+    }
+    if (strcmp(args[1], "-m") == 0) {
+        return nw_m(args, background, redirects);
+    } else if (strcmp(args[1], "-w") == 0) {
+        return nw_w(args, background, redirects);
+    } else if (strcmp(args[1], "-p") == 0) {
+        return nw_p(args, background, redirects);
+    } else if (strcmp(args[1], "-s") == 0) {
+        return nw_s(args, background, redirects);
+    } else if (strcmp(args[1], "-l") == 0) {
+        return nw_l(args, background, redirects);
+    } else if (strcmp(args[1], "-b") == 0) {
+        return nw_b(args, background, redirects);
+    } else if (strcmp(args[1], "-r") == 0) {
+        return nw_r(args, background, redirects);
+    } else if (strcmp(args[1], "-d") == 0) {
+        return nw_d(args, background, redirects);
+    } else if (strcmp(args[1], "-c") == 0) {
+        return nw_c(args, background, redirects);
     } else {
         printf("Invalid argument for nw\n");
         return -1;
@@ -476,161 +3052,3279 @@ int nw_handler(char **args, int background, char *outputfile) {
 }
 
 
-char *readLine(void) {
-    char *line = NULL;
-    size_t bufsize = 0;
+int execute(char **args, int background, const FdPlan *redirects);
+
+static double timeval_seconds(struct timeval tv) {
+    return (double) tv.tv_sec + (double) tv.tv_usec / 1e6;
+}
+
+/*
+ * Run the rest of the line and report its cost on stderr. External commands
+ * are measured through the wait4() rusage collected by newProcess, builtins
+ * through the shell's own getrusage() delta. maxrss is the peak of the
+ * largest child reaped; with no child it can only be the shell's own peak
+ * over its whole life, and is labelled so.
+ */
+int time_command(char **args, int background, const FdPlan *redirects) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "Usage: time command [args...]\n");
+        return -1;
+    }
+    struct rusage self_before, self_after, usage;
+    memset(&child_usage, 0, sizeof(child_usage));
+    getrusage(RUSAGE_SELF, &self_before);
+    uint64_t begin = monotonic_ns();
+
+    int status = execute(args + 1, background, redirects);
+
+    uint64_t elapsed = monotonic_ns() - begin;
+    getrusage(RUSAGE_SELF, &self_after);
+    fflush(stdout);
+
+    usage = child_usage;
+    long child_maxrss = child_usage.ru_maxrss; // 0 when no child was reaped
+    timersub(&self_after.ru_utime, &self_before.ru_utime, &self_after.ru_utime);
+    timersub(&self_after.ru_stime, &self_before.ru_stime, &self_after.ru_stime);
+    self_after.ru_minflt -= self_before.ru_minflt;
+    self_after.ru_majflt -= self_before.ru_majflt;
+    self_after.ru_nvcsw -= self_before.ru_nvcsw;
+    self_after.ru_nivcsw -= self_before.ru_nivcsw;
+    add_rusage(&usage, &self_after);
+
+    fprintf(stderr, "real\t%.6fs\n", (double) elapsed / 1e9);
+    fprintf(stderr, "user\t%.6fs\n", timeval_seconds(usage.ru_utime));
+    fprintf(stderr, "sys\t%.6fs\n", timeval_seconds(usage.ru_stime));
+    if (child_maxrss > 0) {
+        fprintf(stderr, "maxrss\t%ld KB\n", child_maxrss);
+    } else {
+        fprintf(stderr, "maxrss\t%ld KB (shell)\n", self_after.ru_maxrss);
+    }
+    fprintf(stderr, "faults\t%ld minor, %ld major\n", usage.ru_minflt, usage.ru_majflt);
+    fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n", usage.ru_nvcsw, usage.ru_nivcsw);
+    return status;
+}
+
+#define SPAWN_BENCH_MAX_PARALLEL 4096
+
+static long resident_kb(void) {
+    char path[256];
+    long pages = 0, resident = 0;
+    snprintf(path, sizeof(path), "%s/self/statm", proc_root);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(fp);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * Launch args count times with parallel children in flight, going through
+ * launch_process() like newProcess does. The launch histogram is the time
+ * the parent spends in fork/vfork/posix_spawn/clone3, which is where the
+ * shell's RSS shows up; spawn-to-exit runs until the child is reaped.
+ */
+static int spawn_bench_run(char **args, const FdPlan *redirects, int mode, int count, int parallel,
+                           LatencyHistogram *launch, LatencyHistogram *lifetime, int *failed) {
+    pid_t *pids = calloc(parallel, sizeof(pid_t));
+    uint64_t *started = calloc(parallel, sizeof(uint64_t));
+    if (!pids || !started) {
+        free(pids);
+        free(started);
+        return -1;
+    }
+    int launched = 0, running = 0, result = 0;
+    *failed = 0;
+    while (launched < count || running > 0) {
+        for (int slot = 0; slot < parallel && launched < count && running < parallel; slot++) {
+            if (pids[slot] != 0) {
+                continue;
+            }
+            uint64_t start = monotonic_ns();
+            pid_t pid = launch_process(args, redirects, mode);
+            if (pid < 0) {
+                result = -1;
+                count = launched; // stop launching, reap what is in flight
+                break;
+            }
+            histogram_record(launch, monotonic_ns() - start);
+            pids[slot] = pid;
+            started[slot] = start;
+            launched++;
+            running++;
+        }
+        if (running == 0) {
+            break;
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            result = -1;
+            break;
+        }
+        uint64_t now = monotonic_ns();
+        for (int slot = 0; slot < parallel; slot++) {
+            if (pids[slot] == pid) {
+                histogram_record(lifetime, now - started[slot]);
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    (*failed)++;
+                }
+                pids[slot] = 0;
+                running--;
+                pid = 0;
+                break;
+            }
+        }
+        if (pid > 0) {
+            job_exited(pid, status); // a background job from the shell
+        }
+    }
+    free(pids);
+    free(started);
+    return result;
+}
+
+int spawn_bench(char **args, int background, const FdPlan *redirects) {
+    int count = 1000, parallel = 1, mode = SPAWN_FORK, valid = 1;
+    long inflate_mb = 0;
+    int i = 2;
+    for (; valid && args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL) {
+            count = atoi(args[++i]);
+        } else if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL) {
+            parallel = atoi(args[++i]);
+        } else if (strcmp(args[i], "--inflate") == 0 && args[i + 1] != NULL) {
+            inflate_mb = atol(args[++i]);
+            valid = inflate_mb > 0;
+        } else if (strcmp(args[i], "--mode") == 0 && args[i + 1] != NULL) {
+            for (mode = 0; mode < SPAWN_MODES && strcmp(args[i + 1], spawn_mode_names[mode]) != 0; mode++);
+            valid = mode < SPAWN_MODES;
+            i++;
+        } else {
+            valid = 0;
+        }
+    }
+    if (!valid || args[i] == NULL || count <= 0 || parallel <= 0 || parallel > SPAWN_BENCH_MAX_PARALLEL) {
+        printf("Usage: bench spawn [-n N] [-j P] [--mode fork|vfork|posix_spawn|clone3] [--inflate MB] CMD\n");
+        return -1;
+    }
+    parallel = parallel < count ? parallel : count;
+
+    // Touch every page so fork() has to copy page tables for all of it
+    char *ballast = NULL;
+    if (inflate_mb > 0) {
+        ballast = malloc(inflate_mb << 20);
+        if (!ballast) {
+            perror("Failed to inflate the heap");
+            return -1;
+        }
+        memset(ballast, 1, inflate_mb << 20);
+    }
+    long rss = resident_kb();
+
+    static LatencyHistogram launch, lifetime;
+    memset(&launch, 0, sizeof(launch));
+    memset(&lifetime, 0, sizeof(lifetime));
+    int failed = 0;
+    uint64_t begin = monotonic_ns();
+    int result = spawn_bench_run(args + i, redirects, mode, count, parallel, &launch, &lifetime, &failed);
+    uint64_t elapsed = monotonic_ns() - begin;
+    int error = errno;
+    free(ballast);
+
+    printf("Spawned %llu/%d '%s' with %s in %.3f s, %d in flight: %.1f spawns/s\n",
+           (unsigned long long) lifetime.count, count, args[i], spawn_mode_names[mode], (double) elapsed / 1e9,
+           parallel, (double) lifetime.count / ((double) elapsed / 1e9));
+    printf("Shell RSS %.1f MB", rss / 1024.0);
+    if (inflate_mb > 0) {
+        printf(" (heap inflated by %ld MB)", inflate_mb);
+    }
+    if (failed) {
+        printf(", %d exited with an error", failed);
+    }
+    printf("\n");
+    if (launch.count) {
+        printf("Launch (us): avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+               (double) launch.sum / (double) launch.count / 1e3, histogram_percentile(&launch, 50) / 1e3,
+               histogram_percentile(&launch, 99) / 1e3, launch.max / 1e3);
+    }
+    if (lifetime.count) {
+        printf("Spawn-to-exit (us): min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f\n", lifetime.min / 1e3,
+               (double) lifetime.sum / (double) lifetime.count / 1e3, histogram_percentile(&lifetime, 50) / 1e3,
+               histogram_percentile(&lifetime, 99) / 1e3, lifetime.max / 1e3);
+    }
+    if (result < 0) {
+        fprintf(stderr, "Failed to spawn %s with %s: %s\n", args[i], spawn_mode_names[mode], strerror(error));
+        return -1;
+    }
+    return failed ? -1 : 0;
+}
+
+int bench(char **args, int background, const FdPlan *redirects) {
+    if (args[1] != NULL && strcmp(args[1], "spawn") == 0) {
+        return spawn_bench(args, background, redirects);
+    }
+    fprintf(stderr, "Usage: bench spawn [options] CMD\n");
+    return -1;
+}
+
+#define STATS_NAME_LENGTH 32
+
+typedef struct {
+    char name[STATS_NAME_LENGTH];
+    LatencyHistogram phases[PHASE_COUNT];
+} CommandStats;
+
+CommandStats *command_stats;
+int command_stats_count = 0;
+
+static CommandStats *find_command_stats(const char *name) {
+    for (int i = 0; i < command_stats_count; i++) {
+        if (strncmp(command_stats[i].name, name, STATS_NAME_LENGTH - 1) == 0) {
+            return &command_stats[i];
+        }
+    }
+    CommandStats *grown = realloc(command_stats, (command_stats_count + 1) * sizeof(CommandStats));
+    if (!grown) {
+        return NULL;
+    }
+    command_stats = grown;
+    CommandStats *entry = &command_stats[command_stats_count++];
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    return entry;
+}
+
+// Fold the phase times of the command that just finished into its histograms
+void record_command_stats(const char *name) {
+    CommandStats *entry = find_command_stats(name);
+    for (int phase = 0; entry && phase < PHASE_COUNT; phase++) {
+        if (phase_used[phase]) {
+            histogram_record(&entry->phases[phase], phase_elapsed[phase]);
+        }
+    }
+    memset(phase_elapsed, 0, sizeof(phase_elapsed));
+    memset(phase_used, 0, sizeof(phase_used));
+}
+
+static const char *format_duration(uint64_t ns, char *buffer, size_t size) {
+    if (ns < 1000) {
+        snprintf(buffer, size, "%lluns", (unsigned long long) ns);
+    } else if (ns < 1000000) {
+        snprintf(buffer, size, "%.1fus", (double) ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buffer, size, "%.1fms", (double) ns / 1e6);
+    } else {
+        snprintf(buffer, size, "%.2fs", (double) ns / 1e9);
+    }
+    return buffer;
+}
+
+int stats(char **args, int background, const FdPlan *redirects) {
+    if (args[1] != NULL) {
+        if (strcmp(args[1], "--reset") != 0) {
+            fprintf(stderr, "Usage: stats [--reset]\n");
+            return -1;
+        }
+        free(command_stats);
+        command_stats = NULL;
+        command_stats_count = 0;
+        return 0;
+    }
+
+    printf("%-16s %-9s %8s %10s %10s %10s %10s\n", "Command", "Phase", "Count", "p50", "p99", "p999", "Total");
+    for (int i = 0; i < command_stats_count; i++) {
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            LatencyHistogram *h = &command_stats[i].phases[phase];
+            if (h->count == 0) {
+                continue;
+            }
+            char p50[16], p99[16], p999[16], total[16];
+            printf("%-16s %-9s %8llu %10s %10s %10s %10s\n", command_stats[i].name, phase_names[phase],
+                   (unsigned long long) h->count, format_duration(histogram_percentile(h, 50), p50, sizeof(p50)),
+                   format_duration(histogram_percentile(h, 99), p99, sizeof(p99)),
+                   format_duration(histogram_percentile(h, 99.9), p999, sizeof(p999)),
+                   format_duration(h->sum, total, sizeof(total)));
+        }
+    }
+    return 0;
+}
+
+char *trace_file = NULL;
+
+// Write the recorded events as Chrome trace-event JSON, loadable in Perfetto
+static int dump_trace(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror("Failed to open the trace file");
+        return -1;
+    }
+    uint64_t head = atomic_load_explicit(&trace_ring->head, memory_order_acquire);
+    uint64_t first = head > TRACE_CAPACITY ? head - TRACE_CAPACITY : 0;
+    int written = 0;
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (uint64_t index = first; index < head; index++) {
+        TraceEvent *slot = &trace_ring->events[index & (TRACE_CAPACITY - 1)], copy;
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != index + 1) {
+            continue; // overwritten or still being written
+        }
+        copy.start = slot->start;
+        copy.duration = slot->duration;
+        copy.pid = slot->pid;
+        copy.phase = slot->phase;
+        memcpy(copy.name, slot->name, sizeof(copy.name));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) != index + 1) {
+            continue; // a writer wrapped around onto the slot while it was copied
+        }
+        TraceEvent *event = &copy;
+        event->name[TRACE_NAME_LENGTH - 1] = '\0';
+        if (event->phase < 0 || event->phase > TRACE_FLUSH) {
+            continue;
+        }
+        if (event->phase == TRACE_EXEC) {
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                        "\"pid\":%d,\"tid\":%d,\"args\":{\"command\":\"", written ? "," : "",
+                    trace_phase_names[event->phase], (double) event->start / 1e3, event->pid, event->pid);
+        } else {
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":%d,\"tid\":%d,\"args\":{\"command\":\"", written ? "," : "",
+                    trace_phase_names[event->phase], (double) event->start / 1e3, (double) event->duration / 1e3,
+                    event->pid, event->pid);
+        }
+        for (const char *c = event->name; *c; c++) {
+            if (*c == '"' || *c == '\\') {
+                fputc('\\', fp);
+            }
+            fputc((unsigned char) *c < 0x20 ? '?' : *c, fp);
+        }
+        fprintf(fp, "\"}}");
+        written++;
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    printf("Wrote %d trace events to %s", written, path);
+    if (first > 0) {
+        printf(" (%llu older events were overwritten)", (unsigned long long) first);
+    }
+    printf("\n");
+    return 0;
+}
+
+int trace(char **args, int background, const FdPlan *redirects) {
+    if (args[1] != NULL && strcmp(args[1], "on") == 0 && args[2] != NULL) {
+        if (trace_ring) {
+            fprintf(stderr, "Tracing is already on, writing to %s\n", trace_file);
+            return -1;
+        }
+        void *map = mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            perror("Failed to allocate the trace buffer");
+            return -1;
+        }
+        trace_ring = map;
+        trace_pid = getpid();
+        trace_file = strdup(args[2]);
+        return 0;
+    }
+    if (args[1] != NULL && strcmp(args[1], "off") == 0) {
+        if (!trace_ring) {
+            fprintf(stderr, "Tracing is not on\n");
+            return -1;
+        }
+        int status = dump_trace(trace_file);
+        munmap(trace_ring, sizeof(TraceRing));
+        trace_ring = NULL;
+        free(trace_file);
+        trace_file = NULL;
+        return status;
+    }
+    fprintf(stderr, "Usage: trace on FILE | trace off\n");
+    return -1;
+}
+
+#define HISTORY_FILE ".shell_history"
+#define HISTORY_SEARCH_LIMIT 20
+
+typedef struct {
+    const char *text; // points into the block read at startup, or is owned for lines added this session
+    uint32_t length;
+    uint32_t owned;
+} HistoryEntry;
+
+// Posting list of one trigram: indices of the entries containing it, ascending
+typedef struct {
+    uint32_t trigram; // 0 marks an empty slot
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *entries;
+} TrigramPostings;
+
+static HistoryEntry *history;
+static size_t history_count, history_capacity;
+static int history_fd = -1;
+static TrigramPostings *trigram_index;
+static size_t trigram_capacity, trigram_used;
+static size_t trigram_indexed; // entries below this are in the index
+
+static int history_push(const char *text, size_t length, int owned) {
+    if (history_count >= history_capacity) {
+        size_t capacity = history_capacity ? 2 * history_capacity : 1024;
+        HistoryEntry *grown = realloc(history, capacity * sizeof(HistoryEntry));
+        if (!grown) {
+            return -1;
+        }
+        history = grown;
+        history_capacity = capacity;
+    }
+    history[history_count].text = text;
+    history[history_count].length = (uint32_t) length;
+    history[history_count].owned = owned;
+    history_count++;
+    return 0;
+}
+
+/*
+ * Read the history file into one block and record where each line starts,
+ * so startup costs one read and one memchr pass. The block is a private
+ * copy: another shell truncating or rewriting the file cannot pull lines
+ * out from under the entries, as it could with a mapping. A last line
+ * without its newline is being appended by another shell and is left out.
+ */
+void load_history(void) {
+    char path[1024];
+    const char *file = getenv("HISTFILE");
+    if (!file) {
+        const char *home = getenv("HOME");
+        snprintf(path, sizeof(path), "%s/%s", home ? home : ".", HISTORY_FILE);
+        file = path;
+    }
+    history_fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    int read_fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (history_fd < 0 || read_fd < 0 || fstat(read_fd, &st) < 0) {
+        perror("Failed to open the history file");
+        if (read_fd >= 0) {
+            close(read_fd);
+        }
+        return;
+    }
+    char *text = st.st_size > 0 ? malloc(st.st_size) : NULL;
+    size_t filled = 0;
+    while (text && filled < (size_t) st.st_size) {
+        ssize_t n = read(read_fd, text + filled, st.st_size - filled);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break; // the file shrank since fstat(), keep what was read
+        }
+        filled += n;
+    }
+    if (st.st_size > 0) {
+        if (!text) {
+            perror("Failed to read the history file");
+        } else {
+            const char *end = text + filled;
+            for (const char *line = text; line < end;) {
+                const char *newline = memchr(line, '\n', end - line);
+                if (!newline) {
+                    break;
+                }
+                if (newline > line) {
+                    history_push(line, newline - line, 0);
+                }
+                line = newline + 1;
+            }
+        }
+    }
+    close(read_fd);
+}
+
+// One O_APPEND writev per line, so lines from concurrent shells never interleave
+void history_add(const char *line) {
+    size_t length = strlen(line);
+    char *copy = strdup(line);
+    if (length == 0 || !copy || history_push(copy, length, 1) < 0) {
+        free(copy);
+        return;
+    }
+    if (history_fd >= 0) {
+        struct iovec parts[2] = {{copy, length}, {"\n", 1}};
+        if (writev(history_fd, parts, 2) < 0) {
+            perror("Failed to append to the history file");
+        }
+    }
+}
+
+static uint32_t trigram_key(const char *text) {
+    return (uint32_t) (unsigned char) text[0] << 16 | (uint32_t) (unsigned char) text[1] << 8 |
+           (unsigned char) text[2];
+}
+
+static TrigramPostings *trigram_slot(TrigramPostings *table, size_t capacity, uint32_t trigram) {
+    size_t mask = capacity - 1;
+    size_t i = (trigram * 2654435761U) & mask;
+    while (table[i].trigram != 0 && table[i].trigram != trigram) {
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+static int trigram_add(uint32_t trigram, uint32_t entry) {
+    if (2 * (trigram_used + 1) > trigram_capacity) {
+        size_t capacity = trigram_capacity ? 2 * trigram_capacity : 4096;
+        TrigramPostings *table = calloc(capacity, sizeof(TrigramPostings));
+        if (!table) {
+            return -1;
+        }
+        for (size_t i = 0; i < trigram_capacity; i++) {
+            if (trigram_index[i].trigram != 0) {
+                *trigram_slot(table, capacity, trigram_index[i].trigram) = trigram_index[i];
+            }
+        }
+        free(trigram_index);
+        trigram_index = table;
+        trigram_capacity = capacity;
+    }
+    TrigramPostings *slot = trigram_slot(trigram_index, trigram_capacity, trigram);
+    if (slot->trigram == 0) {
+        slot->trigram = trigram;
+        trigram_used++;
+    }
+    if (slot->count > 0 && slot->entries[slot->count - 1] == entry) {
+        return 0; // trigram repeated within the same line
+    }
+    if (slot->count >= slot->capacity) {
+        uint32_t capacity = slot->capacity ? 2 * slot->capacity : 4;
+        uint32_t *entries = realloc(slot->entries, capacity * sizeof(uint32_t));
+        if (!entries) {
+            return -1;
+        }
+        slot->entries = entries;
+        slot->capacity = capacity;
+    }
+    slot->entries[slot->count++] = entry;
+    return 0;
+}
+
+// The index is built on the first search rather than at startup, then kept up to date
+static void trigram_index_update(void) {
+    for (; trigram_indexed < history_count; trigram_indexed++) {
+        const HistoryEntry *entry = &history[trigram_indexed];
+        for (uint32_t i = 0; i + 3 <= entry->length; i++) {
+            trigram_add(trigram_key(entry->text + i), (uint32_t) trigram_indexed);
+        }
+    }
+}
+
+static int history_matches(const HistoryEntry *entry, const char *needle, size_t length, int prefix) {
+    if (prefix) {
+        return entry->length >= length && memcmp(entry->text, needle, length) == 0;
+    }
+    return memmem(entry->text, entry->length, needle, length) != NULL;
+}
+
+/*
+ * Index of the most recent entry before `before` that contains needle (or
+ * starts with it when prefix is set), -1 if there is none. Needles of three
+ * bytes or more only verify the entries in the shortest posting list among
+ * their trigrams.
+ */
+long history_search(const char *needle, size_t before, int prefix) {
+    size_t length = strlen(needle);
+    if (before > history_count) {
+        before = history_count;
+    }
+    if (length < 3) {
+        for (size_t i = before; i-- > 0;) {
+            if (history_matches(&history[i], needle, length, prefix)) {
+                return (long) i;
+            }
+        }
+        return -1;
+    }
+
+    trigram_index_update();
+    const TrigramPostings *rarest = NULL;
+    for (size_t i = 0; i + 3 <= length; i++) {
+        const TrigramPostings *postings = trigram_slot(trigram_index, trigram_capacity, trigram_key(needle + i));
+        if (postings->trigram == 0) {
+            return -1;
+        }
+        if (!rarest || postings->count < rarest->count) {
+            rarest = postings;
+        }
+    }
+    size_t low = 0, high = rarest->count; // first posting at or after `before`
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (rarest->entries[mid] < before) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    while (low-- > 0) {
+        if (history_matches(&history[rarest->entries[low]], needle, length, prefix)) {
+            return (long) rarest->entries[low];
+        }
+    }
+    return -1;
+}
+
+// Resolve !!, !n and !prefix to a fresh copy of the history line, NULL if there is no such event
+char *expand_history(const char *line) {
+    long index = -1;
+    if (strcmp(line, "!!") == 0) {
+        index = (long) history_count - 1;
+    } else if (isdigit((unsigned char) line[1])) {
+        char *end;
+        long n = strtol(line + 1, &end, 10);
+        index = *end == '\0' && n >= 1 && (size_t) n <= history_count ? n - 1 : -1;
+    } else {
+        index = history_search(line + 1, history_count, 1);
+    }
+    if (index < 0) {
+        return NULL;
+    }
+    return strndup(history[index].text, history[index].length);
+}
+
+int history_command(char **args, int background, const FdPlan *redirects) {
+    if (args[1] != NULL && strcmp(args[1], "-s") == 0 && args[2] != NULL) {
+        size_t before = history_count;
+        for (int found = 0; found < HISTORY_SEARCH_LIMIT; found++) {
+            long index = history_search(args[2], before, 0);
+            if (index < 0) {
+                break;
+            }
+            printf("%5ld  %.*s\n", index + 1, (int) history[index].length, history[index].text);
+            before = (size_t) index;
+        }
+        return 0;
+    }
+    size_t first = 0;
+    if (args[1] != NULL) {
+        char *end;
+        long last = strtol(args[1], &end, 10);
+        if (*end != '\0' || last <= 0) {
+            fprintf(stderr, "Usage: history [N] | history -s TEXT\n");
+            return -1;
+        }
+        first = (size_t) last < history_count ? history_count - last : 0;
+    }
+    for (size_t i = first; i < history_count; i++) {
+        printf("%5zu  %.*s\n", i + 1, (int) history[i].length, history[i].text);
+    }
+    return 0;
+}
+
+/* Builtin names, in the order execute() dispatches them; also the first completion source */
+char *builtin_func_list[] = {
+        "set",
+        "get",
+        "ls",
+        "hls",
+        "cd",
+        "cat",
+        "?",
+        "pstatus",
+        "sysfo",
+        "nw",
+        "time",
+        "stats",
+        "trace",
+        "bench",
+        "history",
+        "parallel",
+        "jobs",
+        "export",
+        "exit",
+        NULL // Marks the end of the array
+};
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} TextBuffer;
+
+static int text_append(TextBuffer *text, const char *bytes, size_t length) {
+    if (text->length + length + 1 > text->capacity) {
+        size_t capacity = text->capacity ? text->capacity : 128;
+        while (capacity < text->length + length + 1) {
+            capacity *= 2;
+        }
+        char *grown = realloc(text->data, capacity);
+        if (!grown) {
+            return -1;
+        }
+        text->data = grown;
+        text->capacity = capacity;
+    }
+    memcpy(text->data + text->length, bytes, length);
+    text->length += length;
+    text->data[text->length] = '\0';
+    return 0;
+}
+
+static void text_set(TextBuffer *text, const char *bytes, size_t length) {
+    text->length = 0;
+    text_append(text, bytes, length);
+}
+
+/*
+ * Trie of executable names in a flat node array: each node holds one byte
+ * and links to its first child and next sibling, so a rebuild only resets
+ * the node count. Node 0 is the root.
+ */
+typedef struct {
+    int child;   // first child, -1 if none
+    int sibling; // next sibling, -1 if none
+    char byte;
+    char terminal;
+} TrieNode;
+
+typedef struct {
+    TrieNode *nodes;
+    int count;
+    int capacity;
+} Trie;
+
+static int trie_node(Trie *trie, char byte) {
+    if (trie->count >= trie->capacity) {
+        int capacity = trie->capacity ? 2 * trie->capacity : 4096;
+        TrieNode *grown = realloc(trie->nodes, capacity * sizeof(TrieNode));
+        if (!grown) {
+            return -1;
+        }
+        trie->nodes = grown;
+        trie->capacity = capacity;
+    }
+    TrieNode *node = &trie->nodes[trie->count];
+    node->child = node->sibling = -1;
+    node->byte = byte;
+    node->terminal = 0;
+    return trie->count++;
+}
+
+static void trie_reset(Trie *trie) {
+    trie->count = 0;
+    trie_node(trie, '\0');
+}
+
+static int trie_child(const Trie *trie, int node, char byte) {
+    int child = trie->nodes[node].child;
+    while (child >= 0 && trie->nodes[child].byte != byte) {
+        child = trie->nodes[child].sibling;
+    }
+    return child;
+}
+
+static void trie_insert(Trie *trie, const char *word) {
+    int node = 0;
+    for (; *word; word++) {
+        int child = trie_child(trie, node, *word);
+        if (child < 0) {
+            if ((child = trie_node(trie, *word)) < 0) {
+                return;
+            }
+            trie->nodes[child].sibling = trie->nodes[node].child;
+            trie->nodes[node].child = child;
+        }
+        node = child;
+    }
+    trie->nodes[node].terminal = 1;
+}
+
+typedef struct {
+    char **items;
+    int count;
+    int capacity;
+} Completions;
+
+static void completions_add(Completions *completions, const char *word, size_t length) {
+    if (completions->count >= completions->capacity) {
+        int capacity = completions->capacity ? 2 * completions->capacity : 32;
+        char **grown = realloc(completions->items, capacity * sizeof(char *));
+        if (!grown) {
+            return;
+        }
+        completions->items = grown;
+        completions->capacity = capacity;
+    }
+    char *copy = strndup(word, length);
+    if (copy) {
+        completions->items[completions->count++] = copy;
+    }
+}
+
+static void completions_clear(Completions *completions) {
+    for (int i = 0; i < completions->count; i++) {
+        free(completions->items[i]);
+    }
+    completions->count = 0;
+}
+
+// Add every word below node; word holds the bytes on the path to it
+static void trie_collect(const Trie *trie, int node, TextBuffer *word, Completions *out) {
+    if (trie->nodes[node].terminal) {
+        completions_add(out, word->data, word->length);
+    }
+    for (int child = trie->nodes[node].child; child >= 0; child = trie->nodes[child].sibling) {
+        text_append(word, &trie->nodes[child].byte, 1);
+        trie_collect(trie, child, word, out);
+        word->data[--word->length] = '\0';
+    }
+}
+
+typedef struct {
+    char *path;
+    struct timespec mtime; // zero when the directory did not exist
+} PathDir;
+
+static Trie executables;
+static char *executables_path; // the PATH value the trie was built from
+static PathDir *path_dirs;
+static int path_dir_count;
+
+static struct timespec directory_mtime(const char *path) {
+    struct stat st;
+    struct timespec none = {0, 0};
+    return stat(path, &st) == 0 ? st.st_mtim : none;
+}
+
+static void add_executables(const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type == DT_DIR || strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        struct stat st;
+        if (entry->d_type != DT_REG &&
+            (fstatat(dirfd(dir), entry->d_name, &st, 0) < 0 || S_ISDIR(st.st_mode))) {
+            continue;
+        }
+        if (faccessat(dirfd(dir), entry->d_name, X_OK, 0) == 0) {
+            trie_insert(&executables, entry->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * Rebuild the executable trie when PATH changed or one of its directories
+ * has a new mtime. Called on Tab only, and a check is one stat() per PATH
+ * directory, so directories are rescanned only after they change.
+ */
+static void refresh_executables(void) {
+    const char *path = getenv("PATH");
+    path = path ? path : "";
+    int stale = executables_path == NULL || strcmp(executables_path, path) != 0;
+    for (int i = 0; !stale && i < path_dir_count; i++) {
+        struct timespec mtime = directory_mtime(path_dirs[i].path);
+        stale = mtime.tv_sec != path_dirs[i].mtime.tv_sec || mtime.tv_nsec != path_dirs[i].mtime.tv_nsec;
+    }
+    if (!stale) {
+        return;
+    }
+
+    for (int i = 0; i < path_dir_count; i++) {
+        free(path_dirs[i].path);
+    }
+    free(executables_path);
+    executables_path = strdup(path);
+    path_dir_count = 0;
+    trie_reset(&executables);
+    for (const char *start = path;; start++) {
+        const char *end = strchr(start, ':');
+        size_t length = end ? (size_t) (end - start) : strlen(start);
+        PathDir *grown = realloc(path_dirs, (path_dir_count + 1) * sizeof(PathDir));
+        if (!grown) {
+            break;
+        }
+        path_dirs = grown;
+        PathDir *dir = &path_dirs[path_dir_count++];
+        dir->path = length ? strndup(start, length) : strdup("."); // an empty entry means the cwd
+        dir->mtime = directory_mtime(dir->path); // taken before the scan, so a racing change triggers a rescan
+        add_executables(dir->path);
+        if (!end) {
+            break;
+        }
+        start = end;
+    }
+}
+
+static void complete_path(const char *word, size_t length, Completions *out) {
+    const char *slash = memrchr(word, '/', length);
+    size_t dir_length = slash ? (size_t) (slash - word) + 1 : 0;
+    char dir_path[1024];
+    snprintf(dir_path, sizeof(dir_path), "%.*s", (int) dir_length, dir_length ? word : "./");
+    const char *base = word + dir_length;
+    size_t base_length = length - dir_length;
+
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        return;
+    }
+    struct dirent *entry;
+    char candidate[2048];
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, base, base_length) != 0 || strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0 || (entry->d_name[0] == '.' && base_length == 0)) {
+            continue;
+        }
+        struct stat st;
+        int is_dir = entry->d_type == DT_DIR || ((entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) &&
+                                                  fstatat(dirfd(dir), entry->d_name, &st, 0) == 0 &&
+                                                  S_ISDIR(st.st_mode));
+        int n = snprintf(candidate, sizeof(candidate), "%.*s%s%s", (int) dir_length, word, entry->d_name,
+                         is_dir ? "/" : "");
+        completions_add(out, candidate, (size_t) n < sizeof(candidate) ? (size_t) n : sizeof(candidate) - 1);
+    }
+    closedir(dir);
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * Candidates for the word before the cursor: variables after '$', builtins
+ * and PATH executables in command position, file paths otherwise.
+ */
+static void collect_completions(const char *word, size_t length, int command_position, Completions *out) {
+    if (length > 0 && word[0] == '$') {
+        for (int i = 0; i < varCount; i++) {
+            if (strncmp(variables[i].name, word + 1, length - 1) == 0) {
+                char candidate[64];
+                int n = snprintf(candidate, sizeof(candidate), "$%s", variables[i].name);
+                completions_add(out, candidate, n);
+            }
+        }
+    } else if (command_position && !memchr(word, '/', length)) {
+        for (int i = 0; builtin_func_list[i] != NULL; i++) {
+            if (strncmp(builtin_func_list[i], word, length) == 0) {
+                completions_add(out, builtin_func_list[i], strlen(builtin_func_list[i]));
+            }
+        }
+        refresh_executables();
+        int node = 0;
+        for (size_t i = 0; i < length && node >= 0; i++) {
+            node = trie_child(&executables, node, word[i]);
+        }
+        if (node >= 0) {
+            TextBuffer prefix = {0};
+            text_append(&prefix, word, length);
+            trie_collect(&executables, node, &prefix, out);
+            free(prefix.data);
+        }
+    } else {
+        complete_path(word, length, out);
+    }
+
+    // Builtins and executables may share a name
+    qsort(out->items, out->count, sizeof(char *), compare_strings);
+    int unique = 0;
+    for (int i = 0; i < out->count; i++) {
+        if (unique > 0 && strcmp(out->items[unique - 1], out->items[i]) == 0) {
+            free(out->items[i]);
+        } else {
+            out->items[unique++] = out->items[i];
+        }
+    }
+    out->count = unique;
+}
+
+enum {
+    KEY_CTRL_A = 1, KEY_CTRL_B = 2, KEY_CTRL_C = 3, KEY_CTRL_D = 4, KEY_CTRL_E = 5, KEY_CTRL_F = 6,
+    KEY_CTRL_G = 7, KEY_BACKSPACE_CTRL_H = 8, KEY_TAB = 9, KEY_CTRL_K = 11, KEY_CTRL_L = 12, KEY_ENTER = 13,
+    KEY_CTRL_N = 14, KEY_CTRL_P = 16, KEY_CTRL_R = 18, KEY_CTRL_U = 21, KEY_CTRL_W = 23, KEY_ESCAPE = 27,
+    KEY_BACKSPACE = 127, KEY_LEFT = 1000, KEY_RIGHT, KEY_UP, KEY_DOWN, KEY_HOME, KEY_END, KEY_DELETE
+};
+
+#define COMPLETION_LIST_LIMIT 100
+
+typedef struct {
+    const char *prompt;
+    TextBuffer line;
+    size_t cursor;
+    size_t history_index; // history_count while editing a new line
+    TextBuffer saved;     // the new line while browsing history
+    TextBuffer frame;     // everything one keystroke writes to the terminal
+    int searching;
+    TextBuffer query;
+    long match;
+    int last_key;
+} LineEditor;
+
+static struct termios original_termios;
+static int raw_mode = 0;
+
+static void disable_raw_mode(void) {
+    if (raw_mode) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &original_termios);
+        raw_mode = 0;
+    }
+}
+
+// Output processing stays on, so "\n" still moves to the start of the next line
+static int enable_raw_mode(void) {
+    static int registered = 0;
+    if (tcgetattr(STDIN_FILENO, &original_termios) < 0) {
+        return -1;
+    }
+    if (!registered) {
+        atexit(disable_raw_mode);
+        registered = 1;
+    }
+    struct termios raw = original_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cflag |= CS8;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) < 0) {
+        return -1;
+    }
+    raw_mode = 1;
+    return 0;
+}
+
+// Returns a byte, one of the KEY_ values for escape sequences, or -1 at end of input
+static int read_key(void) {
+    unsigned char c, sequence[3];
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR);
+    if (n <= 0) {
+        return -1;
+    }
+    if (c != KEY_ESCAPE) {
+        return c;
+    }
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, 50) <= 0 || read(STDIN_FILENO, &sequence[0], 1) != 1 ||
+        read(STDIN_FILENO, &sequence[1], 1) != 1) {
+        return KEY_ESCAPE;
+    }
+    if (sequence[0] == '[' && sequence[1] >= '0' && sequence[1] <= '9') {
+        if (read(STDIN_FILENO, &sequence[2], 1) != 1 || sequence[2] != '~') {
+            return KEY_ESCAPE;
+        }
+        switch (sequence[1]) {
+            case '1':
+            case '7':
+                return KEY_HOME;
+            case '3':
+                return KEY_DELETE;
+            case '4':
+            case '8':
+                return KEY_END;
+            default:
+                return KEY_ESCAPE;
+        }
+    }
+    if (sequence[0] == '[' || sequence[0] == 'O') {
+        switch (sequence[1]) {
+            case 'A':
+                return KEY_UP;
+            case 'B':
+                return KEY_DOWN;
+            case 'C':
+                return KEY_RIGHT;
+            case 'D':
+                return KEY_LEFT;
+            case 'H':
+                return KEY_HOME;
+            case 'F':
+                return KEY_END;
+        }
+    }
+    return KEY_ESCAPE;
+}
+
+/*
+ * Append the redraw of the prompt and line to whatever the keystroke
+ * already queued in the frame, then send it all with one write(). Lines
+ * wider than the terminal scroll horizontally to keep the cursor visible.
+ */
+static void editor_refresh(LineEditor *ed, int finished) {
+    char search_prompt[256];
+    const char *prompt = ed->prompt;
+    const char *text = ed->line.data ? ed->line.data : "";
+    size_t length = ed->line.length, cursor = ed->cursor;
+    if (ed->searching) {
+        snprintf(search_prompt, sizeof(search_prompt), "(reverse-i-search)`%s': ",
+                 ed->query.data ? ed->query.data : "");
+        prompt = search_prompt;
+        text = ed->match >= 0 ? history[ed->match].text : "";
+        length = cursor = ed->match >= 0 ? history[ed->match].length : 0;
+    }
+
+    struct winsize ws;
+    size_t columns = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    size_t prompt_length = strlen(prompt);
+    size_t room = columns > prompt_length + 1 ? columns - prompt_length - 1 : 1;
+    size_t offset = cursor > room ? cursor - room : 0;
+    size_t shown = length - offset < room ? length - offset : room;
+
+    char move[32];
+    text_append(&ed->frame, "\r", 1);
+    text_append(&ed->frame, prompt, prompt_length);
+    text_append(&ed->frame, text + offset, shown);
+    text_append(&ed->frame, "\x1b[K\r", 4);
+    size_t column = prompt_length + cursor - offset;
+    if (column > 0) {
+        text_append(&ed->frame, move, snprintf(move, sizeof(move), "\x1b[%zuC", column));
+    }
+    if (finished) {
+        text_append(&ed->frame, "\n", 1);
+    }
+    if (write(STDOUT_FILENO, ed->frame.data, ed->frame.length) < 0) {
+        perror("Failed to write to the terminal");
+    }
+    ed->frame.length = 0;
+}
+
+static void editor_insert(LineEditor *ed, const char *bytes, size_t length) {
+    size_t tail = ed->line.length - ed->cursor;
+    if (text_append(&ed->line, bytes, length) < 0) {
+        return;
+    }
+    memmove(ed->line.data + ed->cursor + length, ed->line.data + ed->cursor, tail);
+    memcpy(ed->line.data + ed->cursor, bytes, length);
+    ed->cursor += length;
+}
+
+static void editor_erase(LineEditor *ed, size_t from, size_t to) {
+    memmove(ed->line.data + from, ed->line.data + to, ed->line.length - to + 1);
+    ed->line.length -= to - from;
+    ed->cursor = from;
+}
+
+static void editor_history(LineEditor *ed, int direction) {
+    if ((direction < 0 && ed->history_index == 0) || (direction > 0 && ed->history_index >= history_count)) {
+        return;
+    }
+    if (ed->history_index == history_count) {
+        text_set(&ed->saved, ed->line.data ? ed->line.data : "", ed->line.length);
+    }
+    ed->history_index += direction;
+    if (ed->history_index == history_count) {
+        text_set(&ed->line, ed->saved.data, ed->saved.length);
+    } else {
+        text_set(&ed->line, history[ed->history_index].text, history[ed->history_index].length);
+    }
+    ed->cursor = ed->line.length;
+}
+
+static void editor_complete(LineEditor *ed) {
+    size_t start = ed->cursor;
+    while (start > 0 && ed->line.data[start - 1] != ' ') {
+        start--;
+    }
+    int command_position = 1;
+    for (size_t i = 0; i < start; i++) {
+        command_position &= ed->line.data[i] == ' ';
+    }
+    const char *word = ed->line.data ? ed->line.data + start : "";
+    size_t length = ed->cursor - start;
+
+    static Completions completions;
+    completions_clear(&completions);
+    collect_completions(word, length, command_position, &completions);
+    if (completions.count == 0) {
+        text_append(&ed->frame, "\a", 1);
+        return;
+    }
+
+    size_t common = strlen(completions.items[0]);
+    for (int i = 1; i < completions.count; i++) {
+        size_t j = 0;
+        while (j < common && completions.items[i][j] == completions.items[0][j]) {
+            j++;
+        }
+        common = j;
+    }
+    if (common > length || completions.count == 1) {
+        editor_erase(ed, start, ed->cursor);
+        editor_insert(ed, completions.items[0], common);
+        if (completions.count == 1 && completions.items[0][common - 1] != '/') {
+            editor_insert(ed, " ", 1);
+        }
+    } else if (ed->last_key == KEY_TAB) {
+        // Second Tab without progress: list the candidates above the line
+        text_append(&ed->frame, "\r\n", 2);
+        for (int i = 0; i < completions.count && i < COMPLETION_LIST_LIMIT; i++) {
+            text_append(&ed->frame, completions.items[i], strlen(completions.items[i]));
+            text_append(&ed->frame, "  ", 2);
+        }
+        if (completions.count > COMPLETION_LIST_LIMIT) {
+            char more[64];
+            text_append(&ed->frame, more, snprintf(more, sizeof(more), "... %d more",
+                                                   completions.count - COMPLETION_LIST_LIMIT));
+        }
+        text_append(&ed->frame, "\x1b[K\r\n", 5);
+    } else {
+        text_append(&ed->frame, "\a", 1);
+    }
+}
+
+// Keys while in Ctrl-R search; returns 1 when the key leaves search mode and still needs handling
+static int editor_search_key(LineEditor *ed, int key) {
+    if (key == KEY_CTRL_R) {
+        long older = ed->match >= 0 ? history_search(ed->query.data, ed->match, 0) : -1;
+        if (older >= 0) {
+            ed->match = older;
+        } else {
+            text_append(&ed->frame, "\a", 1);
+        }
+        return 0;
+    }
+    if (key == KEY_BACKSPACE || key == KEY_BACKSPACE_CTRL_H || (key >= 32 && key < KEY_BACKSPACE) || key > 127) {
+        if (key == KEY_BACKSPACE || key == KEY_BACKSPACE_CTRL_H) {
+            if (ed->query.length > 0) {
+                ed->query.data[--ed->query.length] = '\0';
+            }
+        } else {
+            char byte = (char) key;
+            text_append(&ed->query, &byte, 1);
+        }
+        ed->match = ed->query.length ? history_search(ed->query.data, history_count, 0) : -1;
+        if (ed->query.length && ed->match < 0) {
+            text_append(&ed->frame, "\a", 1);
+        }
+        return 0;
+    }
+    ed->searching = 0;
+    if (key == KEY_CTRL_G || key == KEY_CTRL_C) {
+        return 0; // cancelled, the line is as it was before the search
+    }
+    if (ed->match >= 0) {
+        text_set(&ed->line, history[ed->match].text, history[ed->match].length);
+        ed->cursor = ed->line.length;
+    }
+    return key != KEY_ESCAPE;
+}
+
+/*
+ * Read one line from the terminal with editing, history browsing, Ctrl-R
+ * search and tab completion. Returns 1 with the line, 0 at end of input and
+ * -1 if the terminal cannot be put into raw mode.
+ */
+static int edit_line(const char *prompt, char **result) {
+    if (enable_raw_mode() < 0) {
+        return -1;
+    }
+    static LineEditor ed;
+    ed.prompt = prompt;
+    text_set(&ed.line, "", 0);
+    ed.cursor = 0;
+    ed.history_index = history_count;
+    ed.searching = 0;
+    ed.last_key = 0;
+    editor_refresh(&ed, 0);
+
+    for (;;) {
+        int key = read_key();
+        if (key < 0) {
+            disable_raw_mode();
+            return 0;
+        }
+        if (ed.searching && !editor_search_key(&ed, key)) {
+            editor_refresh(&ed, 0);
+            ed.last_key = key;
+            continue;
+        }
+        switch (key) {
+            case KEY_ENTER:
+            case '\n':
+                ed.cursor = ed.line.length;
+                editor_refresh(&ed, 1);
+                disable_raw_mode();
+                *result = strdup(ed.line.data);
+                return *result ? 1 : 0;
+            case KEY_CTRL_D:
+                if (ed.line.length == 0) {
+                    text_append(&ed.frame, "\r\n", 2);
+                    write(STDOUT_FILENO, ed.frame.data, ed.frame.length);
+                    ed.frame.length = 0;
+                    disable_raw_mode();
+                    return 0;
+                }
+                /* fall through */
+            case KEY_DELETE:
+                if (ed.cursor < ed.line.length) {
+                    editor_erase(&ed, ed.cursor, ed.cursor + 1);
+                }
+                break;
+            case KEY_BACKSPACE:
+            case KEY_BACKSPACE_CTRL_H:
+                if (ed.cursor > 0) {
+                    editor_erase(&ed, ed.cursor - 1, ed.cursor);
+                }
+                break;
+            case KEY_CTRL_C:
+                text_append(&ed.frame, "^C\r\n", 4);
+                text_set(&ed.line, "", 0);
+                ed.cursor = 0;
+                ed.history_index = history_count;
+                break;
+            case KEY_LEFT:
+            case KEY_CTRL_B:
+                ed.cursor -= ed.cursor > 0;
+                break;
+            case KEY_RIGHT:
+            case KEY_CTRL_F:
+                ed.cursor += ed.cursor < ed.line.length;
+                break;
+            case KEY_HOME:
+            case KEY_CTRL_A:
+                ed.cursor = 0;
+                break;
+            case KEY_END:
+            case KEY_CTRL_E:
+                ed.cursor = ed.line.length;
+                break;
+            case KEY_UP:
+            case KEY_CTRL_P:
+                editor_history(&ed, -1);
+                break;
+            case KEY_DOWN:
+            case KEY_CTRL_N:
+                editor_history(&ed, 1);
+                break;
+            case KEY_CTRL_K:
+                editor_erase(&ed, ed.cursor, ed.line.length);
+                break;
+            case KEY_CTRL_U:
+                editor_erase(&ed, 0, ed.cursor);
+                break;
+            case KEY_CTRL_W: {
+                size_t start = ed.cursor;
+                while (start > 0 && ed.line.data[start - 1] == ' ') {
+                    start--;
+                }
+                while (start > 0 && ed.line.data[start - 1] != ' ') {
+                    start--;
+                }
+                editor_erase(&ed, start, ed.cursor);
+                break;
+            }
+            case KEY_CTRL_L:
+                text_append(&ed.frame, "\x1b[H\x1b[2J", 7);
+                break;
+            case KEY_CTRL_R:
+                ed.searching = 1;
+                ed.match = -1;
+                text_set(&ed.query, "", 0);
+                break;
+            case KEY_TAB:
+                editor_complete(&ed);
+                break;
+            default:
+                if (key >= 32 && key <= 255 && key != KEY_BACKSPACE) {
+                    char byte = (char) key;
+                    editor_insert(&ed, &byte, 1);
+                }
+                break;
+        }
+        editor_refresh(&ed, 0);
+        ed.last_key = key;
+    }
+}
+
+char *readLine(const char *prompt) {
+    char *line = NULL;
+    size_t bufsize = 0;
+
+    if (isatty(STDIN_FILENO) && isatty(STDOUT_FILENO)) {
+        int status = edit_line(prompt, &line);
+        if (status == 0) {
+            exit(EXIT_SUCCESS); /* ctrl + d on an empty line */
+        } else if (status > 0) {
+            return (line);
+        }
+    }
+    printf("%s", prompt); /* not a terminal, or it refused raw mode */
+    fflush(stdout);
+    if (getline(&line, &bufsize, stdin) == -1) /* if getline fails */
+    {
+        if (feof(stdin)) /* test for the eof */
+        {
+            free(line);         /* avoid memory leaks when ctrl + d */
+            exit(EXIT_SUCCESS); /* we received an eof */
+        } else {
+            free(line); /* avoid memory leaks when getline fails */
+            perror("error while reading the line from stdin");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return (line);
+}
+
+/*
+ * Byte-class scanning for the tokenizers: find the first byte of a small
+ * set (always including the terminating NUL). x86-64 compares 32 bytes at
+ * a time with AVX2 when the CPU has it, else 16 with SSE2; other targets
+ * use a lookup table. Vector loads are aligned, so they never cross into
+ * an unmapped page even though they may read past the terminator.
+ */
+typedef struct {
+    unsigned char member[256];
+    unsigned char bytes[16];
+    int count;
+} ByteSet;
+
+static void byte_set_init(ByteSet *set, const char *bytes, int count) {
+    memset(set, 0, sizeof(*set));
+    for (int i = 0; i < count && i < (int) sizeof(set->bytes); i++) {
+        set->bytes[set->count++] = (unsigned char) bytes[i];
+        set->member[(unsigned char) bytes[i]] = 1;
+    }
+}
+
+static size_t scan_bytes_scalar(const char *text, const ByteSet *set) {
+    const unsigned char *p = (const unsigned char *) text;
+    while (!set->member[*p]) {
+        p++;
+    }
+    return (const char *) p - text;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+__attribute__((no_sanitize_address))
+static size_t scan_bytes_sse2(const char *text, const ByteSet *set) {
+    const char *block = (const char *) ((uintptr_t) text & ~(uintptr_t) 15);
+    unsigned skip = (unsigned) (text - block);
+    for (;; block += 16, skip = 0) {
+        __m128i chunk = _mm_load_si128((const __m128i *) block);
+        __m128i hits = _mm_setzero_si128();
+        for (int i = 0; i < set->count; i++) {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8((char) set->bytes[i])));
+        }
+        unsigned mask = (unsigned) _mm_movemask_epi8(hits) & (~0u << skip);
+        if (mask) {
+            return block + __builtin_ctz(mask) - text;
+        }
+    }
+}
+
+__attribute__((target("avx2"), no_sanitize_address))
+static size_t scan_bytes_avx2(const char *text, const ByteSet *set) {
+    const char *block = (const char *) ((uintptr_t) text & ~(uintptr_t) 31);
+    unsigned skip = (unsigned) (text - block);
+    for (;; block += 32, skip = 0) {
+        __m256i chunk = _mm256_load_si256((const __m256i *) block);
+        __m256i hits = _mm256_setzero_si256();
+        for (int i = 0; i < set->count; i++) {
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8((char) set->bytes[i])));
+        }
+        unsigned mask = (unsigned) _mm256_movemask_epi8(hits) & (~0u << skip);
+        if (mask) {
+            return block + __builtin_ctz(mask) - text;
+        }
+    }
+}
+#endif
+
+static size_t (*scan_bytes)(const char *text, const ByteSet *set);
+
+/*
+ * Marks the lexer leaves in words for the expansion step: LITERAL_MARK
+ * makes the byte after it literal (a quoted or escaped $, *, ? or [),
+ * QUOTED_MARK stands where a quote was removed (keeping an empty quoted
+ * word and ending a $name before it), and QUOTED_DOLLAR is a '$' inside
+ * double quotes, whose value is neither split nor globbed. Expansion adds
+ * FIELD_BREAK where an unquoted value had blanks, to split the word there.
+ */
+#define LITERAL_MARK '\x01'
+#define QUOTED_MARK '\x02'
+#define QUOTED_DOLLAR '\x03'
+#define FIELD_BREAK '\x04'
+
+static ByteSet word_bytes;         // ends or interrupts an unquoted word
+static ByteSet single_quote_bytes; // inside '...'
+static ByteSet double_quote_bytes; // inside "..."
+
+static void init_scanner(void) {
+    if (scan_bytes) {
+        return;
+    }
+    byte_set_init(&word_bytes, "\0 \t\n'\"\\;&|<>\x01\x02\x03\x04", 16);
+    byte_set_init(&single_quote_bytes, "\0'$*?[\x01\x02\x03\x04", 10);
+    byte_set_init(&double_quote_bytes, "\0\"\\$*?[\x01\x02\x03\x04", 11);
+    scan_bytes = scan_bytes_scalar;
+#if defined(__x86_64__)
+    scan_bytes = __builtin_cpu_supports("avx2") ? scan_bytes_avx2 : scan_bytes_sse2;
+#endif
+}
+
+#define PARALLEL_FAILURES_SHOWN 5
+
+typedef struct {
+    const char *arg;
+    pid_t pid;
+    int fd;         // read end of the job's output pipe, -1 once drained
+    int pidfd;      // readable once the job exits, -1 once reaped or without pidfd_open
+    int status;     // wait status once reaped
+    int reaped;
+    TextBuffer output; // held until every earlier job has been written
+} ParallelJob;
+
+static void write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("parallel: write");
+            return;
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+static int parallel_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Start one job with stdout and stderr on a fresh pipe; {} in the template is replaced by arg, else it is appended
+static int parallel_start(char **command, ParallelJob *job) {
+    int count = 0, substituted = 0;
+    while (command[count] != NULL) {
+        count++;
+    }
+    char **argv = malloc((count + 2) * sizeof(char *));
+    int fds[2];
+    if (!argv || pipe2(fds, O_CLOEXEC) < 0) {
+        free(argv);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        substituted |= strcmp(command[i], "{}") == 0;
+        argv[i] = strcmp(command[i], "{}") == 0 ? (char *) job->arg : command[i];
+    }
+    argv[count] = substituted ? NULL : (char *) job->arg;
+    argv[count + 1] = NULL;
+
+    child_environment(); /* build it once here rather than in every child */
+    job->pid = fork();
+    if (job->pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        exec_child(argv, NULL);
+    }
+    free(argv);
+    close(fds[1]);
+    if (job->pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    job->fd = fds[0];
+    job->pidfd = parallel_pidfd(job->pid);
+    job->output.length = 0;
+    return 0;
+}
+
+/*
+ * Collect a job if it has exited; returns 1 if it was reaped. Only this
+ * run's children are waited for, the shell's own jobs are left to reap_jobs().
+ */
+static int parallel_reap(ParallelJob *job) {
+    int status;
+    if (waitpid(job->pid, &status, WNOHANG) <= 0) {
+        return 0;
+    }
+    job->status = status;
+    job->reaped = 1;
+    if (job->pidfd >= 0) {
+        close(job->pidfd);
+        job->pidfd = -1;
+    }
+    return 1;
+}
+
+/*
+ * Run every job with at most max_jobs in flight from a single poll loop
+ * over the output pipes and the jobs' pidfds, so a slot is refilled as
+ * soon as its job exits. Output of the oldest unfinished job streams
+ * straight to out_fd, later jobs buffer theirs until it is their turn, so
+ * the combined output is in argument order.
+ */
+static void parallel_run(char **command, ParallelJob *jobs, int job_count, int max_jobs, int out_fd) {
+    // A reaped job can still have output in its pipe, so more pipes than max_jobs may be open
+    struct pollfd *pfds = malloc(2 * job_count * sizeof(struct pollfd));
+    int *pfd_jobs = malloc(2 * job_count * sizeof(int));
+    int started = 0, running = 0, next_output = 0;
+    char buffer[65536];
+
+    while (next_output < job_count && pfds && pfd_jobs) {
+        while (running < max_jobs && started < job_count) {
+            ParallelJob *job = &jobs[started++];
+            if (parallel_start(command, job) < 0) {
+                perror("parallel: failed to start a job");
+                job->fd = job->pidfd = -1;
+                job->reaped = 1;
+                job->status = EXIT_FAILURE << 8;
+                continue;
+            }
+            running++;
+        }
+
+        // Wait for output or an exit; only a job without a pidfd has to be polled for
+        int polled = 0, unwatched = 0;
+        for (int i = next_output; i < started; i++) {
+            if (jobs[i].fd >= 0) {
+                pfds[polled].fd = jobs[i].fd;
+                pfds[polled].events = POLLIN;
+                pfd_jobs[polled++] = i;
+            }
+            if (!jobs[i].reaped && jobs[i].pidfd >= 0) {
+                pfds[polled].fd = jobs[i].pidfd;
+                pfds[polled].events = POLLIN;
+                pfd_jobs[polled++] = i;
+            } else if (!jobs[i].reaped) {
+                unwatched = 1;
+            }
+        }
+        if (polled > 0 && poll(pfds, polled, unwatched ? 10 : -1) < 0 && errno != EINTR) {
+            perror("parallel: poll");
+            break;
+        }
+        if (polled == 0 && unwatched) {
+            poll(NULL, 0, 10);
+        }
+        for (int p = 0; p < polled; p++) {
+            if (!(pfds[p].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            ParallelJob *job = &jobs[pfd_jobs[p]];
+            if (pfds[p].fd == job->pidfd) {
+                running -= parallel_reap(job);
+                continue;
+            }
+            ssize_t n = read(job->fd, buffer, sizeof(buffer));
+            if (n > 0 && pfd_jobs[p] == next_output) {
+                write_all(out_fd, buffer, n);
+            } else if (n > 0) {
+                text_append(&job->output, buffer, n);
+            } else if (n == 0 || errno != EINTR) {
+                close(job->fd);
+                job->fd = -1;
+            }
+        }
+
+        for (int i = next_output; i < started; i++) {
+            if (!jobs[i].reaped && jobs[i].pidfd < 0) {
+                running -= parallel_reap(&jobs[i]);
+            }
+        }
+
+        while (next_output < job_count && next_output < started && jobs[next_output].reaped &&
+               jobs[next_output].fd < 0) {
+            next_output++;
+            if (next_output < started && jobs[next_output].output.length > 0) {
+                write_all(out_fd, jobs[next_output].output.data, jobs[next_output].output.length);
+                jobs[next_output].output.length = 0;
+            }
+        }
+    }
+    free(pfds);
+    free(pfd_jobs);
+}
+
+int parallel(char **args, int background, const FdPlan *redirects) {
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+    if (args[i] != NULL && strcmp(args[i], "-j") == 0 && args[i + 1] != NULL) {
+        max_jobs = atol(args[i + 1]);
+        i += 2;
+    }
+    char **command = args + i;
+    int separator = i;
+    while (args[separator] != NULL && strcmp(args[separator], ":::") != 0) {
+        separator++;
+    }
+    if (max_jobs <= 0 || command[0] == NULL || separator == i) {
+        fprintf(stderr, "Usage: parallel [-j N] command [args] [{}] ::: arg... (arguments from stdin without :::)\n");
+        return -1;
+    }
+
+    char **inputs = NULL;
+    int input_count = 0, from_stdin = args[separator] == NULL;
+    if (!from_stdin) {
+        args[separator] = NULL; // the command ends at :::
+        inputs = &args[separator + 1];
+        while (inputs[input_count] != NULL) {
+            input_count++;
+        }
+    } else {
+        // One argument per line of stdin, read through the same stream as the shell's own input
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t length;
+        while ((length = getline(&line, &size, stdin)) > 0) {
+            if (line[length - 1] == '\n') {
+                line[length - 1] = '\0';
+            }
+            char **grown = realloc(inputs, (input_count + 1) * sizeof(char *));
+            if (!grown) {
+                break;
+            }
+            inputs = grown;
+            inputs[input_count++] = strdup(line);
+        }
+        free(line);
+        clearerr(stdin); // a terminal can keep reading commands after ctrl + d
+    }
+
+    ParallelJob *jobs = calloc(input_count ? input_count : 1, sizeof(ParallelJob));
+    int out_fd = redirect_target(redirects, STDOUT_FILENO);
+    if (!jobs) {
+        perror("parallel");
+        free(jobs);
+        return -1;
+    }
+    for (int j = 0; j < input_count; j++) {
+        jobs[j].arg = inputs[j];
+        jobs[j].fd = -1;
+    }
+    fflush(stdout);
+    uint64_t begin = monotonic_ns();
+    parallel_run(command, jobs, input_count, max_jobs < input_count ? max_jobs : input_count, out_fd);
+    uint64_t elapsed = monotonic_ns() - begin;
+
+    int failed = 0;
+    for (int j = 0; j < input_count; j++) {
+        int status = jobs[j].status;
+        free(jobs[j].output.data);
+        if (jobs[j].reaped && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            continue;
+        }
+        if (++failed <= PARALLEL_FAILURES_SHOWN) {
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "parallel: job %d (%s) killed by signal %d\n", j + 1, jobs[j].arg, WTERMSIG(status));
+            } else {
+                fprintf(stderr, "parallel: job %d (%s) exited with %d\n", j + 1, jobs[j].arg, WEXITSTATUS(status));
+            }
+        }
+    }
+    fprintf(stderr, "parallel: %d jobs, %d succeeded, %d failed in %.3f s with up to %ld in flight\n",
+            input_count, input_count - failed, failed, (double) elapsed / 1e9, max_jobs);
+    if (from_stdin) {
+        for (int j = 0; j < input_count; j++) {
+            free(inputs[j]);
+        }
+        free(inputs);
+    }
+    free(jobs);
+    return failed ? -1 : 0;
+}
+
+int is_builtin(const char *name) {
+    for (int i = 0; builtin_func_list[i] != NULL; i++) {
+        if (strcmp(name, builtin_func_list[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Builtins that change the shell itself keep running in it even when given
+ * &, and ls and cat already hand & to newProcess. Of the nw modes only -p
+ * and -w stay: nw -p keeps its socket owner cache in the shell, and nw -w
+ * is stopped with Ctrl-C. The other collectors run as jobs.
+ */
+static int builtin_runs_in_background(char **args) {
+    static const char *in_shell[] = {"set", "get", "cd", "exit", "trace", "stats", "history", "jobs", "export",
+                                     "ls", "cat", NULL};
+    for (int i = 0; in_shell[i] != NULL; i++) {
+        if (strcmp(args[0], in_shell[i]) == 0) {
+            return 0;
+        }
+    }
+    if (strcmp(args[0], "nw") == 0 && args[1] != NULL &&
+        (strcmp(args[1], "-p") == 0 || strcmp(args[1], "-w") == 0)) {
+        return 0;
+    }
+    return is_builtin(args[0]);
+}
+
+/* Run a builtin in a forked subshell registered as a job, so the prompt comes back at once */
+static int run_builtin_in_background(char **args, const FdPlan *redirects) {
+    fflush(stdout); /* the subshell must not repeat buffered output */
+    pid_t pid = fork();
+    if (pid == 0) {
+        trace_pid = getpid();
+        if (plan_apply(redirects) < 0) {
+            perror("error in execute: redirect");
+            _exit(EXIT_FAILURE);
+        }
+        int status = execute(args, 0, NULL);
+        fflush(stdout);
+        _exit(status < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    } else if (pid < 0) {
+        perror("error in execute: forking a subshell");
+        return -1;
+    }
+    char command[JOB_COMMAND_LENGTH];
+    join_args(args, command, sizeof(command));
+    add_job(pid, command);
+    return 0;
+}
+
+int execute(char **args, int background, const FdPlan *redirects) {
+    int (*builtin_func[])(char **, int, const FdPlan *) = {
+            &set,
+            &get,
+            &ls,
+            &hls,
+            &cd,
+            &cat,
+            &explain,
+            &pstatus_p,
+            &sysfo,
+            &nw_handler,
+            &time_command,
+            &stats,
+            &trace,
+            &bench,
+            &history_command,
+            &parallel,
+            &jobs_command,
+            &export_command,
+            NULL // Marks the end of the array
+    };
+    int i = 0;
+
+    if (args[0] == NULL) {
+        /* empty command was entered */
+        printf("\n");
+        return (-1);
+    }
+
+    if (background && builtin_runs_in_background(args)) {
+        return run_builtin_in_background(args, redirects);
+    }
+    if (background && strcmp(args[0], "nw") == 0) {
+        fprintf(stderr, "nw %s: & ignored, it runs in the shell\n", args[1]);
+    }
+
+    /* Add a check for pstatus command with its arguments */
+    if (strcmp(args[0], "pstatus") == 0) {
+        if (args[1] != NULL) {
+            if (strcmp(args[1], "-p") == 0) {
+                return pstatus_p(args, background, redirects);
+            } else if (strcmp(args[1], "-i") == 0) {
+                return pstatus_i(args, background, redirects);
+            } else if (strcmp(args[1], "-t") == 0) {
+                return pstatus_t(args, background, redirects);
+            } else {
+                printf("Invalid argument for pstatus\n");
+                return -1;
+            }
+        } else {
+            printf("Usage: pstatus [-p|-i|-t]\n");
+            return -1;
+        }
+    }
+
+    /* Add a check for nw command with its arguments */
+    if (strcmp(args[0], "nw") == 0) {
+        return nw_handler(args, background, redirects);
+    }
+
+    /* find if the command is a builtin */
+    for (; builtin_func_list[i] != NULL; i++) {
+        /* if there is a match execute the builtin command */
+        if (strcmp(args[0], builtin_func_list[i]) == 0) {
+            if (builtin_func[i] == NULL) {
+                exit(0); // Exit command
+            }
+            return ((*builtin_func[i])(args, background, redirects));
+        }
+    }
+    /* create a new process */
+    return newProcess(args, background, redirects);
+}
+
+/*
+ * Command lines are lexed and parsed into an AST in one pass, then the tree
+ * is walked directly. Grammar:
+ *
+ *   list     := and_or ((';' | '&') and_or)* [';' | '&']
+ *   and_or   := pipeline (('&&' | '||') pipeline)*
+ *   pipeline := command ('|' command)*
+ *   command  := (WORD | REDIRECT WORD)+
+ *   REDIRECT := [0-9] ('<' | '>' | '>>' | '<&' | '>&') | '&>' | '&>>'
+ *
+ * Words and nodes live in an arena that is reset after each line.
+ */
+#define ARENA_CHUNK_SIZE 4096
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *first;
+    ArenaChunk *current; // chunks before it are full for this line
+} Arena;
+
+static void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t) 7;
+    ArenaChunk *chunk = arena->current, *last = NULL;
+    while (chunk && chunk->used + size > chunk->capacity) {
+        last = chunk;
+        chunk = chunk->next;
+    }
+    if (!chunk) {
+        size_t capacity = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(ArenaChunk) + capacity);
+        if (!chunk) {
+            fprintf(stderr, "allocation error in arena_alloc\n");
+            exit(EXIT_FAILURE);
+        }
+        chunk->next = NULL;
+        chunk->used = 0;
+        chunk->capacity = capacity;
+        if (last) {
+            last->next = chunk;
+        } else {
+            arena->first = chunk;
+        }
+    }
+    arena->current = chunk;
+    void *memory = chunk->data + chunk->used;
+    chunk->used += size;
+    return memory;
+}
+
+static char *arena_strndup(Arena *arena, const char *text, size_t length) {
+    char *copy = arena_alloc(arena, length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// Keep the chunks, so after the first few lines parsing allocates nothing
+static void arena_reset(Arena *arena) {
+    for (ArenaChunk *chunk = arena->first; chunk; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    arena->current = arena->first;
+}
+
+enum {
+    TOKEN_WORD, TOKEN_SEMI, TOKEN_AMP, TOKEN_AND, TOKEN_OR, TOKEN_PIPE, TOKEN_REDIRECT, TOKEN_END
+};
+
+enum {
+    REDIRECT_IN,          // [n]<
+    REDIRECT_OUT,         // [n]>
+    REDIRECT_APPEND,      // [n]>>
+    REDIRECT_DUP,         // [n]>&m, [n]<&m, and [n]>&- to close
+    REDIRECT_BOTH,        // &>
+    REDIRECT_BOTH_APPEND  // &>>
+};
+
+typedef struct {
+    int type;
+    int start; // span in the line
+    int end;
+    char *text;   // TOKEN_WORD only
+    int redirect; // TOKEN_REDIRECT only, with the fd it applies to
+    int fd;
+} Token;
+
+typedef struct Redirect {
+    int type;
+    int fd;
+    char *target; // a file name, or the fd to copy for REDIRECT_DUP
+    struct Redirect *next;
+} Redirect;
+
+enum {
+    NODE_COMMAND, NODE_PIPELINE, NODE_AND, NODE_OR, NODE_SEQUENCE, NODE_BACKGROUND
+};
+
+typedef struct Node {
+    int type;
+    struct Node *left; // NODE_AND, NODE_OR, NODE_SEQUENCE; the job for NODE_BACKGROUND
+    struct Node *right;
+    struct Node **stages; // NODE_PIPELINE
+    int stage_count;
+    char **argv;  // NODE_COMMAND, NULL-terminated
+    Redirect *redirects; // NODE_COMMAND, in source order
+    char *text;   // NODE_BACKGROUND, the job's source for the job list
+    int start;    // span in the line
+    int end;
+} Node;
+
+typedef struct {
+    const char *line;
+    Token *tokens;
+    int position;
+    Arena *arena;
+} Parser;
+
+static Token *token_buffer;
+static int token_capacity;
+
+static int push_token(int count, int type, int start, int end, char *text) {
+    if (count >= token_capacity) {
+        int capacity = token_capacity ? 2 * token_capacity : 64;
+        Token *grown = realloc(token_buffer, capacity * sizeof(Token));
+        if (!grown) {
+            fprintf(stderr, "allocation error in lex_line: tokens\n");
+            exit(EXIT_FAILURE);
+        }
+        token_buffer = grown;
+        token_capacity = capacity;
+    }
+    token_buffer[count].type = type;
+    token_buffer[count].start = start;
+    token_buffer[count].end = end;
+    token_buffer[count].text = text;
+    return count + 1;
+}
+
+static void append_literal(TextBuffer *word, char c) {
+    if (c == '$' || c == '*' || c == '?' || c == '[' || (c >= LITERAL_MARK && c <= FIELD_BREAK)) {
+        text_append(word, &(char) {LITERAL_MARK}, 1);
+    }
+    text_append(word, &c, 1);
+}
+
+/*
+ * Lex the word at line + i into the arena and return the index after it,
+ * or -1 for an unterminated quote. A word with no quotes or backslashes is
+ * found with one scan and copied once; others are rebuilt in a scratch
+ * buffer with the quotes removed and LITERAL_MARKs where needed.
+ */
+static int lex_word(const char *line, int i, Arena *arena, char **text) {
+    int start = i;
+    i += (int) scan_bytes(line + i, &word_bytes);
+    char c = line[i];
+    if (c != '\'' && c != '"' && c != '\\' && !(c >= LITERAL_MARK && c <= FIELD_BREAK)) {
+        *text = arena_strndup(arena, line + start, i - start);
+        return i;
+    }
+
+    static TextBuffer word;
+    word.length = 0;
+    text_append(&word, line + start, i - start);
+    for (;;) {
+        c = line[i];
+        if (c == '\'' || c == '"') {
+            const ByteSet *set = c == '\'' ? &single_quote_bytes : &double_quote_bytes;
+            text_append(&word, &(char) {QUOTED_MARK}, 1);
+            for (i++;;) {
+                size_t n = scan_bytes(line + i, set);
+                text_append(&word, line + i, n);
+                i += (int) n;
+                if (line[i] == c) {
+                    text_append(&word, &(char) {QUOTED_MARK}, 1);
+                    i++;
+                    break;
+                } else if (line[i] == '\0') {
+                    return -1;
+                } else if (line[i] == '\\') { /* only inside "...": \ escapes $ " \ ` and newline */
+                    char next = line[i + 1];
+                    if (next == '\n') {
+                        i += 2;
+                    } else if (next == '$' || next == '"' || next == '\\' || next == '`') {
+                        append_literal(&word, next);
+                        i += 2;
+                    } else {
+                        text_append(&word, "\\", 1);
+                        i++;
+                    }
+                } else if (line[i] == '$' && c == '"') {
+                    /* "$?" stays a reference rather than a literal '?' */
+                    text_append(&word, (char[]) {QUOTED_DOLLAR, '?'}, line[i + 1] == '?' ? 2 : 1);
+                    i += line[i + 1] == '?' ? 2 : 1;
+                } else {
+                    append_literal(&word, line[i++]);
+                }
+            }
+        } else if (c == '\\') {
+            if (line[i + 1] == '\0') {
+                text_append(&word, "\\", 1);
+                i++;
+            } else if (line[i + 1] == '\n') {
+                i += 2; /* line continuation */
+            } else {
+                append_literal(&word, line[i + 1]);
+                i += 2;
+            }
+        } else if (c >= LITERAL_MARK && c <= FIELD_BREAK) {
+            append_literal(&word, c);
+            i++;
+        } else {
+            break; /* a blank, an operator or the end of the line */
+        }
+        size_t n = scan_bytes(line + i, &word_bytes);
+        text_append(&word, line + i, n);
+        i += (int) n;
+    }
+
+    *text = arena_strndup(arena, word.data, word.length);
+    return i;
+}
+
+// Lex a redirection operator at line + i and return the index after it
+static int lex_redirect(const char *line, int i, int *redirect, int *fd) {
+    if (line[i] == '&') {
+        *fd = STDOUT_FILENO;
+        *redirect = line[i + 2] == '>' ? REDIRECT_BOTH_APPEND : REDIRECT_BOTH;
+        return i + (*redirect == REDIRECT_BOTH_APPEND ? 3 : 2);
+    }
+    *fd = -1;
+    if (isdigit((unsigned char) line[i])) {
+        *fd = line[i++] - '0';
+    }
+    if (line[i] == '<') {
+        *redirect = line[i + 1] == '&' ? REDIRECT_DUP : REDIRECT_IN;
+        *fd = *fd < 0 ? STDIN_FILENO : *fd;
+    } else {
+        *redirect = line[i + 1] == '>' ? REDIRECT_APPEND : line[i + 1] == '&' ? REDIRECT_DUP : REDIRECT_OUT;
+        *fd = *fd < 0 ? STDOUT_FILENO : *fd;
+    }
+    return i + (*redirect == REDIRECT_IN || *redirect == REDIRECT_OUT ? 1 : 2);
+}
+
+/*
+ * Split the line into words and operators. An unquoted '#' at the start of
+ * a word comments out the rest. Returns NULL after reporting an
+ * unterminated quote.
+ */
+static Token *lex_line(const char *line, Arena *arena) {
+    int count = 0, i = 0;
+    init_scanner();
+    for (;;) {
+        while (line[i] == ' ' || line[i] == '\t' || line[i] == '\n') {
+            i++;
+        }
+        if (line[i] == '\0' || line[i] == '#') {
+            break;
+        }
+        int start = i, type, redirect = 0, fd = 0;
+        char *text = NULL;
+        if (line[i] == ';') {
+            type = TOKEN_SEMI;
+            i++;
+        } else if (line[i] == '<' || line[i] == '>' || (line[i] == '&' && line[i + 1] == '>') ||
+                   (isdigit((unsigned char) line[i]) && (line[i + 1] == '<' || line[i + 1] == '>'))) {
+            type = TOKEN_REDIRECT;
+            i = lex_redirect(line, i, &redirect, &fd);
+        } else if (line[i] == '&') {
+            type = line[i + 1] == '&' ? TOKEN_AND : TOKEN_AMP;
+            i += type == TOKEN_AND ? 2 : 1;
+        } else if (line[i] == '|') {
+            type = line[i + 1] == '|' ? TOKEN_OR : TOKEN_PIPE;
+            i += type == TOKEN_OR ? 2 : 1;
+        } else {
+            type = TOKEN_WORD;
+            if ((i = lex_word(line, i, arena, &text)) < 0) {
+                fprintf(stderr, "syntax error: unterminated quote starting in `%s'\n", line + start);
+                return NULL;
+            }
+        }
+        count = push_token(count, type, start, i, text);
+        token_buffer[count - 1].redirect = redirect;
+        token_buffer[count - 1].fd = fd;
+    }
+    push_token(count, TOKEN_END, i, i, NULL);
+    return token_buffer;
+}
+
+static Node *new_node(Parser *parser, int type, Node *left, Node *right) {
+    Node *node = arena_alloc(parser->arena, sizeof(Node));
+    memset(node, 0, sizeof(Node));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    if (left) {
+        node->start = left->start;
+        node->end = right ? right->end : left->end;
+    }
+    return node;
+}
+
+static Node *syntax_error(Parser *parser) {
+    const Token *token = &parser->tokens[parser->position];
+    if (token->type == TOKEN_END) {
+        fprintf(stderr, "syntax error near unexpected newline\n");
+    } else {
+        fprintf(stderr, "syntax error near unexpected token `%.*s'\n", token->end - token->start,
+                parser->line + token->start);
+    }
+    return NULL;
+}
+
+static Node *parse_command(Parser *parser) {
+    int words = 0;
+    for (int i = parser->position; parser->tokens[i].type == TOKEN_WORD || parser->tokens[i].type == TOKEN_REDIRECT;
+         i++) {
+        words++;
+    }
+    Node *node = new_node(parser, NODE_COMMAND, NULL, NULL);
+    node->argv = arena_alloc(parser->arena, (words + 1) * sizeof(char *));
+    node->start = parser->tokens[parser->position].start;
+    int argc = 0;
+    Redirect **tail = &node->redirects;
+    for (;;) {
+        Token *token = &parser->tokens[parser->position];
+        if (token->type == TOKEN_WORD) {
+            node->argv[argc++] = token->text;
+        } else if (token->type == TOKEN_REDIRECT) {
+            parser->position++;
+            if (parser->tokens[parser->position].type != TOKEN_WORD) {
+                return syntax_error(parser);
+            }
+            Redirect *redirect = arena_alloc(parser->arena, sizeof(Redirect));
+            redirect->type = token->redirect;
+            redirect->fd = token->fd;
+            redirect->target = parser->tokens[parser->position].text;
+            redirect->next = NULL;
+            *tail = redirect;
+            tail = &redirect->next;
+        } else {
+            break;
+        }
+        node->end = parser->tokens[parser->position].end;
+        parser->position++;
+    }
+    node->argv[argc] = NULL;
+    if (argc == 0 && !node->redirects) {
+        return syntax_error(parser);
+    }
+    return node;
+}
+
+static Node *parse_pipeline(Parser *parser) {
+    Node *first = parse_command(parser);
+    if (!first || parser->tokens[parser->position].type != TOKEN_PIPE) {
+        return first;
+    }
+    int capacity = 4, count = 0;
+    Node **stages = arena_alloc(parser->arena, capacity * sizeof(Node *));
+    stages[count++] = first;
+    while (parser->tokens[parser->position].type == TOKEN_PIPE) {
+        parser->position++;
+        Node *stage = parse_command(parser);
+        if (!stage) {
+            return NULL;
+        }
+        if (count == capacity) {
+            Node **grown = arena_alloc(parser->arena, 2 * capacity * sizeof(Node *));
+            memcpy(grown, stages, count * sizeof(Node *));
+            stages = grown;
+            capacity *= 2;
+        }
+        stages[count++] = stage;
+    }
+    Node *node = new_node(parser, NODE_PIPELINE, first, stages[count - 1]);
+    node->left = node->right = NULL;
+    node->stages = stages;
+    node->stage_count = count;
+    return node;
+}
+
+static Node *parse_and_or(Parser *parser) {
+    Node *node = parse_pipeline(parser);
+    while (node && (parser->tokens[parser->position].type == TOKEN_AND ||
+                    parser->tokens[parser->position].type == TOKEN_OR)) {
+        int type = parser->tokens[parser->position++].type == TOKEN_AND ? NODE_AND : NODE_OR;
+        Node *right = parse_pipeline(parser);
+        node = right ? new_node(parser, type, node, right) : NULL;
+    }
+    return node;
+}
+
+static Node *parse_list(Parser *parser) {
+    Node *list = NULL;
+    while (parser->tokens[parser->position].type != TOKEN_END) {
+        Node *item = parse_and_or(parser);
+        if (!item) {
+            return NULL;
+        }
+        int type = parser->tokens[parser->position].type;
+        if (type == TOKEN_AMP) {
+            item = new_node(parser, NODE_BACKGROUND, item, NULL);
+            item->text = arena_strndup(parser->arena, parser->line + item->start, item->end - item->start);
+            parser->position++;
+        } else if (type == TOKEN_SEMI) {
+            parser->position++;
+        } else if (type != TOKEN_END) {
+            return syntax_error(parser);
+        }
+        list = list ? new_node(parser, NODE_SEQUENCE, list, item) : item;
+    }
+    return list;
+}
+
+/* Parse a whole line; NULL for an empty line or after reporting a syntax error */
+Node *parse_line(const char *line, Arena *arena) {
+    Parser parser = {line, lex_line(line, arena), 0, arena};
+    return parser.tokens ? parse_list(&parser) : NULL;
+}
+
+static int run_node(const Node *node);
+
+static Arena line_arena; /* parse tree and expanded words of the current line */
+int last_status = 0;     /* $? */
+
+/*
+ * Pathname expansion. A pattern is compiled once per word into one op list
+ * per '/'-separated segment and matched against directory listings read
+ * with getdents64. Listings are cached by device and inode for a couple
+ * of seconds and revalidated against the directory's mtime, so several
+ * globs over the same directory in a line or a script read it once. The
+ * path text is never the key: "." names another directory after a cd.
+ */
+#define DIR_CACHE_SIZE 64
+#define DIR_CACHE_TTL_NS 2000000000ULL
+#define DIR_RACY_NS 10000000LL // mtime granularity: a listing this close to its mtime is not reused
+
+struct dirent_record {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct {
+    int used;             // 0 for a free slot
+    dev_t dev;            // identity of the directory listed
+    ino_t ino;
+    struct timespec mtime;
+    uint64_t read_at;     // monotonic_ns() when listed
+    int racy;             // modified in the same clock tick it was read, so never reused
+    int pinned;           // walks currently iterating it
+    int cached;           // 0 for a listing that did not fit the cache
+    char *names;          // NUL-separated, "." and ".." left out
+    unsigned char *types; // d_type of each name
+    int count;
+} DirListing;
+
+static DirListing dir_cache[DIR_CACHE_SIZE];
+
+static void free_listing(DirListing *listing) {
+    free(listing->names);
+    free(listing->types);
+    listing->used = 0;
+}
+
+static int read_listing(DirListing *listing, const char *path, const struct stat *st) {
+    static char buffer[32768] __attribute__((aligned(8)));
+    TextBuffer names = {0}, types = {0};
+    struct timespec now;
+    struct stat opened;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &opened) < 0 || opened.st_dev != st->st_dev || opened.st_ino != st->st_ino) {
+        close(fd); /* replaced since it was looked up */
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    listing->count = 0;
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+        for (long offset = 0; offset < n;) {
+            struct dirent_record *entry = (struct dirent_record *) (buffer + offset);
+            const char *name = entry->d_name;
+            offset += entry->d_reclen;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            text_append(&names, name, strlen(name) + 1);
+            text_append(&types, (const char *) &entry->d_type, 1);
+            listing->count++;
+        }
+    }
+    close(fd);
+    if (n < 0) {
+        free(names.data);
+        free(types.data);
+        return -1;
+    }
+    listing->used = 1;
+    listing->dev = st->st_dev;
+    listing->ino = st->st_ino;
+    listing->mtime = st->st_mtim;
+    listing->read_at = monotonic_ns();
+    listing->racy = (now.tv_sec - st->st_mtim.tv_sec) * 1000000000LL + (now.tv_nsec - st->st_mtim.tv_nsec) < DIR_RACY_NS;
+    listing->pinned = 1;
+    listing->names = names.data;
+    listing->types = (unsigned char *) types.data;
+    return 0;
+}
+
+// Listing of path, from the cache while it is fresh; release it with release_directory()
+static DirListing *list_directory(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+    uint64_t now = monotonic_ns();
+    DirListing *slot = NULL;
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        DirListing *entry = &dir_cache[i];
+        if (entry->used && entry->dev == st.st_dev && entry->ino == st.st_ino) {
+            if (!entry->racy && now - entry->read_at < DIR_CACHE_TTL_NS &&
+                entry->mtime.tv_sec == st.st_mtim.tv_sec && entry->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                entry->pinned++;
+                return entry;
+            }
+            slot = entry->pinned ? NULL : entry;
+            break;
+        }
+        if (!entry->pinned && (!slot || !entry->used || (slot->used && entry->read_at < slot->read_at))) {
+            slot = entry;
+        }
+    }
+    if (!slot) {
+        /* every slot is in use by a deep ** walk */
+        slot = malloc(sizeof(DirListing));
+        if (!slot) {
+            return NULL;
+        }
+        if (read_listing(slot, path, &st) < 0) {
+            free(slot);
+            return NULL;
+        }
+        slot->cached = 0;
+        return slot;
+    }
+    if (slot->used) {
+        free_listing(slot);
+    }
+    if (read_listing(slot, path, &st) < 0) {
+        return NULL;
+    }
+    slot->cached = 1;
+    return slot;
+}
+
+static void release_directory(DirListing *listing) {
+    listing->pinned--;
+    if (!listing->cached) {
+        free_listing(listing);
+        free(listing);
+    }
+}
+
+enum GlobOpType {
+    GLOB_BYTE,
+    GLOB_ANY,   // ?
+    GLOB_STAR,  // *
+    GLOB_CLASS  // [...]
+};
 
-    if (getline(&line, &bufsize, stdin) == -1) /* if getline fails */
-    {
-        if (feof(stdin)) /* test for the eof */
-        {
-            free(line);         /* avoid memory leaks when ctrl + d */
-            exit(EXIT_SUCCESS); /* we received an eof */
+typedef struct {
+    unsigned char type;
+    unsigned char byte;
+    const unsigned char *class; // 256-bit membership map
+} GlobOp;
+
+typedef struct {
+    GlobOp *ops;
+    int op_count;
+    const char *literal; // the segment itself when it has no wildcards
+    int recursive;       // "**": any number of directories
+    int dot;             // starts with a literal '.', so hidden names may match
+} GlobSegment;
+
+typedef struct {
+    GlobSegment *segments;
+    int count;
+    int trailing_slash;  // pattern ends in '/': directories only
+    TextBuffer path;     // directory being walked, ending in '/' unless empty
+    TextBuffer matches;  // NUL-separated
+    int match_count;
+} Glob;
+
+// Compile the bracket expression at text, returning its length or 0 if it is not closed
+static size_t compile_class(const char *text, size_t length, const unsigned char **class) {
+    unsigned char *bits = arena_alloc(&line_arena, 32);
+    size_t i = 1;
+    int negate = i < length && (text[i] == '!' || text[i] == '^');
+    memset(bits, 0, 32);
+    i += negate;
+    for (int first = 1; i < length && (text[i] != ']' || first); first = 0) {
+        unsigned char low = text[i] == LITERAL_MARK && i + 1 < length ? text[++i] : text[i];
+        unsigned char high = low;
+        i++;
+        if (i + 1 < length && text[i] == '-' && text[i + 1] != ']') {
+            i++;
+            high = text[i] == LITERAL_MARK && i + 1 < length ? text[++i] : text[i];
+            i++;
+        }
+        for (unsigned c = low; c <= high; c++) {
+            bits[c >> 3] |= 1 << (c & 7);
+        }
+    }
+    if (i >= length) {
+        return 0;
+    }
+    if (negate) {
+        for (int b = 0; b < 32; b++) {
+            bits[b] = ~bits[b];
+        }
+    }
+    *class = bits;
+    return i + 1;
+}
+
+static void compile_segment(GlobSegment *segment, const char *text, size_t length) {
+    int wild = 0;
+    segment->ops = arena_alloc(&line_arena, length * sizeof(GlobOp));
+    segment->op_count = 0;
+    segment->literal = NULL;
+    for (size_t i = 0; i < length;) {
+        GlobOp *op = &segment->ops[segment->op_count++];
+        size_t class_length;
+        op->type = GLOB_BYTE;
+        if (text[i] == LITERAL_MARK && i + 1 < length) {
+            op->byte = text[i + 1];
+            i += 2;
+        } else if (text[i] == '*') {
+            wild = 1;
+            op->type = GLOB_STAR;
+            if (segment->op_count > 1 && op[-1].type == GLOB_STAR) {
+                segment->op_count--; /* "**" inside a name is just "*" */
+            }
+            i++;
+        } else if (text[i] == '?') {
+            wild = 1;
+            op->type = GLOB_ANY;
+            i++;
+        } else if (text[i] == '[' && (class_length = compile_class(text + i, length - i, &op->class)) > 0) {
+            wild = 1;
+            op->type = GLOB_CLASS;
+            i += class_length;
         } else {
-            free(line); /* avoid memory leaks when getline fails */
-            perror("error while reading the line from stdin");
-            exit(EXIT_FAILURE);
+            op->byte = text[i++];
         }
     }
-    return (line);
+    segment->recursive = length == 2 && text[0] == '*' && text[1] == '*';
+    segment->dot = segment->op_count > 0 && segment->ops[0].type == GLOB_BYTE && segment->ops[0].byte == '.';
+    if (!wild) {
+        char *literal = arena_alloc(&line_arena, segment->op_count + 1);
+        for (int i = 0; i < segment->op_count; i++) {
+            literal[i] = (char) segment->ops[i].byte;
+        }
+        literal[segment->op_count] = '\0';
+        segment->literal = literal;
+    }
 }
 
-char **splitLine(char *line) {
-    int bufsize = 64;
-    int i = 0;
-    char **tokens = malloc(bufsize * sizeof(char *));
-    char *token;
-    const char TOK_DELIM[2] = " \t";
-    if (!tokens) {
-        fprintf(stderr, "allocation error in splitLine: tokens\n");
-        exit(EXIT_FAILURE);
-    }
-    token = strtok(line, TOK_DELIM);
-    while (token != NULL) {
-        /* handle comments */
-        if (token[0] == '#') {
-            break;
+// Wildcard match with a single backtrack point for the last '*'
+static int glob_match(const GlobSegment *segment, const char *name) {
+    const GlobOp *ops = segment->ops;
+    int count = segment->op_count, op = 0, star_op = -1;
+    const char *text = name, *star_text = NULL;
+    if (name[0] == '.' && !segment->dot) {
+        return 0;
+    }
+    while (*text) {
+        unsigned char c = (unsigned char) *text;
+        if (op < count && ops[op].type == GLOB_STAR) {
+            star_op = ++op;
+            star_text = text;
+        } else if (op < count && (ops[op].type == GLOB_ANY ||
+                                  (ops[op].type == GLOB_BYTE && ops[op].byte == c) ||
+                                  (ops[op].type == GLOB_CLASS && (ops[op].class[c >> 3] >> (c & 7)) & 1))) {
+            op++;
+            text++;
+        } else if (star_op >= 0) {
+            op = star_op;
+            text = ++star_text;
+        } else {
+            return 0;
         }
-        tokens[i] = token;
-        i++;
-        if (i >= bufsize) {
-            bufsize += bufsize;
-            tokens = realloc(tokens, bufsize * sizeof(char *));
-            if (!tokens) {
-                fprintf(stderr, "reallocation error in splitLine: tokens");
-                exit(EXIT_FAILURE);
-            }
-        }
-        token = strtok(NULL, TOK_DELIM);
-    }
-    tokens[i] = NULL;
-    return (tokens);
-}
-
-int execute(char **args, int background, char *output) {
-    char *builtin_func_list[] = {
-            "set",
-            "get",
-            "ls",
-            "hls",
-            "cd",
-            "cat",
-            "?",
-            "pstatus",
-            "sysfo",
-            "nw",
-            "exit",
-            NULL // Marks the end of the array
-    };
-    int (*builtin_func[])(char **, int, char *) = {
-            &set,
-            &get,
-            &ls,
-            &hls,
-            &cd,
-            &cat,
-            &explain,
-            &pstatus_p,
-            &sysfo,
-            &nw_handler,
-            NULL // Marks the end of the array
-    };
-    int i = 0;
+    }
+    while (op < count && ops[op].type == GLOB_STAR) {
+        op++;
+    }
+    return op == count;
+}
 
-    if (args[0] == NULL) {
-        /* empty command was entered */
-        printf("\n");
-        return (-1);
+// Whether the entry just appended to glob->path is a directory; ** does not follow symlinks
+static int glob_is_directory(const Glob *glob, unsigned char type, int follow) {
+    struct stat st;
+    if (type == DT_DIR) {
+        return 1;
+    }
+    if (type != DT_UNKNOWN && (type != DT_LNK || !follow)) {
+        return 0;
+    }
+    return (follow ? stat(glob->path.data, &st) : lstat(glob->path.data, &st)) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void glob_emit(Glob *glob) {
+    text_append(&glob->matches, glob->path.data, glob->path.length + 1);
+    glob->match_count++;
+}
+
+static void glob_walk(Glob *glob, int index) {
+    size_t base = glob->path.length;
+    const GlobSegment *segment = &glob->segments[index];
+    int last = index + 1 == glob->count;
+    struct stat st;
+
+    if (segment->literal) {
+        text_append(&glob->path, segment->literal, strlen(segment->literal));
+        if (!last) {
+            text_append(&glob->path, "/", 1);
+            glob_walk(glob, index + 1);
+        } else if (glob->trailing_slash ? stat(glob->path.data, &st) == 0 && S_ISDIR(st.st_mode)
+                                        : lstat(glob->path.data, &st) == 0) {
+            if (glob->trailing_slash) {
+                text_append(&glob->path, "/", 1);
+            }
+            glob_emit(glob);
+        }
+        glob->path.length = base;
+        glob->path.data[base] = '\0';
+        return;
+    }
+
+    if (segment->recursive && !last) {
+        glob_walk(glob, index + 1); /* ** matching no directory at all */
+    }
+    DirListing *listing = list_directory(base ? glob->path.data : ".");
+    if (!listing) {
+        return;
+    }
+    const char *name = listing->names;
+    for (int i = 0; i < listing->count; name += strlen(name) + 1, i++) {
+        if (segment->recursive ? name[0] == '.' : !glob_match(segment, name)) {
+            continue;
+        }
+        text_append(&glob->path, name, strlen(name));
+        int directory = (!last || glob->trailing_slash || segment->recursive) &&
+                        glob_is_directory(glob, listing->types[i], !segment->recursive);
+        if (last && (directory || !glob->trailing_slash)) {
+            if (glob->trailing_slash) {
+                text_append(&glob->path, "/", 1);
+            }
+            glob_emit(glob);
+            glob->path.length = base + strlen(name);
+        }
+        if (directory && (!last || segment->recursive)) {
+            text_append(&glob->path, "/", 1);
+            glob_walk(glob, segment->recursive ? index : index + 1);
+        }
+        glob->path.length = base;
+        glob->path.data[base] = '\0';
+    }
+    release_directory(listing);
+}
+
+/*
+ * Expand a pattern (with the lexer's LITERAL_MARKs) into the sorted list of
+ * matching paths, allocated in one block of the line arena. Returns the
+ * number of matches; with none, *results is left alone.
+ */
+static int glob_word(const char *pattern, char ***results) {
+    static Glob glob;
+    size_t length = strlen(pattern);
+    int slashes = 0;
+    for (size_t i = 0; i < length; i++) {
+        slashes += pattern[i] == '/';
+    }
+    glob.segments = arena_alloc(&line_arena, (slashes + 1) * sizeof(GlobSegment));
+    glob.count = 0;
+    glob.trailing_slash = length > 1 && pattern[length - 1] == '/';
+    for (const char *start = pattern, *end; *start; start = *end ? end + 1 : end) {
+        end = strchrnul(start, '/');
+        if (end > start) {
+            compile_segment(&glob.segments[glob.count++], start, end - start);
+        }
+    }
+    if (glob.count == 0) {
+        return 0;
+    }
+    text_set(&glob.path, pattern[0] == '/' ? "/" : "", pattern[0] == '/');
+    glob.matches.length = 0;
+    glob.match_count = 0;
+    glob_walk(&glob, 0);
+    if (glob.match_count == 0) {
+        return 0;
+    }
+
+    char **list = arena_alloc(&line_arena, (glob.match_count + 1) * sizeof(char *) + glob.matches.length);
+    char *bytes = (char *) (list + glob.match_count + 1);
+    memcpy(bytes, glob.matches.data, glob.matches.length);
+    for (int i = 0; i < glob.match_count; bytes += strlen(bytes) + 1, i++) {
+        list[i] = bytes;
+    }
+    list[glob.match_count] = NULL;
+    qsort(list, glob.match_count, sizeof(char *), compare_strings);
+    *results = list;
+    return glob.match_count;
+}
+
+static int is_name_char(char c) {
+    return isalnum((unsigned char) c) || c == '_';
+}
+
+#define EXPANSION_BYTES "$*?[\x01\x02\x03" /* bytes expand_word has to act on */
+
+// Drop the LITERAL_MARKs left in an expanded word that is not globbed
+static char *strip_marks(char *word) {
+    char *read = strchr(word, LITERAL_MARK), *write = read;
+    for (; read && *read; read++) {
+        if (*read == LITERAL_MARK && read[1] != '\0') {
+            read++;
+        }
+        *write++ = *read;
+    }
+    if (write) {
+        *write = '\0';
+    }
+    return word;
+}
+
+/*
+ * Expand $name, ${name} and $? in one left-to-right pass and drop the
+ * lexer's QUOTED_MARKs. A word that needs neither is returned as is;
+ * otherwise the pieces go into a reused scratch buffer and the result is
+ * copied once into the line arena. A name the shell has not set is looked
+ * up in the environment, so $HOME and $PATH work; unset everywhere, it
+ * expands to nothing and is counted in *missing. *wild is set when an unquoted *, ? or [ is
+ * left, in which case LITERAL_MARKs stay in the result for glob_word();
+ * they also stay when the word is to be split at FIELD_BREAKs.
+ */
+static char *expand_word(char *word, int *missing, int *wild) {
+    const char *dollar = strpbrk(word, EXPANSION_BYTES);
+    int changed = 0, marked = 0;
+    *wild = 0;
+    if (!dollar) {
+        return word;
     }
+    static TextBuffer scratch;
+    const char *rest = word;
+    scratch.length = 0;
+    for (; dollar; dollar = strpbrk(rest, EXPANSION_BYTES)) {
+        text_append(&scratch, rest, dollar - rest);
+        if (*dollar == '*' || *dollar == '?' || *dollar == '[') {
+            *wild = 1;
+            text_append(&scratch, dollar, 1);
+            rest = dollar + 1;
+            continue;
+        } else if (*dollar == QUOTED_MARK) {
+            changed = 1;
+            rest = dollar + 1;
+            continue;
+        } else if (*dollar == LITERAL_MARK) {
+            changed = marked = 1;
+            text_append(&scratch, dollar, 1 + (dollar[1] != '\0'));
+            rest = dollar + 1 + (dollar[1] != '\0');
+            continue;
+        }
+        changed = 1;
+        const char *name = dollar + 1, *end = name;
+        int braced = *name == '{';
+        if (braced) {
+            end = ++name;
+        }
+        if (*end == '?') {
+            end++;
+        } else {
+            while (is_name_char(*end) && !(end == name && isdigit((unsigned char) *end))) {
+                end++;
+            }
+        }
+        if (end == name || (braced && *end != '}')) {
+            if (*dollar == QUOTED_DOLLAR) {
+                text_append(&scratch, &(char) {LITERAL_MARK}, 1);
+                marked = 1;
+            }
+            text_append(&scratch, "$", 1); /* not a reference, keep the $ */
+            rest = dollar + 1;
+            continue;
+        }
+        rest = braced ? end + 1 : end;
 
-    /* Check if the command is a variable */
-    if (args[0][0] == '$') {
-        char *var_name = args[0] + 1;
-        char *command = getVariable(var_name);
-        if (command) {
-            char **new_args = splitLine(command);
-            int status = execute(new_args, background, output);
-            free(new_args);
-            return status;
+        char buffer[sizeof(variables[0].name)];
+        const char *value = NULL;
+        if (*name == '?') {
+            snprintf(buffer, sizeof(buffer), "%d", last_status);
+            value = buffer;
+        } else if ((size_t) (end - name) < sizeof(buffer)) {
+            memcpy(buffer, name, end - name);
+            buffer[end - name] = '\0';
+            value = getVariable(buffer);
+            if (!value) {
+                value = getenv(buffer);
+            }
+        }
+        if (value && *dollar == QUOTED_DOLLAR) {
+            for (const char *c = value; *c; c++) {
+                if (*c == '*' || *c == '?' || *c == '[' || *c == LITERAL_MARK || *c == FIELD_BREAK) {
+                    text_append(&scratch, &(char) {LITERAL_MARK}, 1);
+                    marked = 1;
+                }
+                text_append(&scratch, c, 1);
+            }
+        } else if (value) {
+            /* unquoted: blanks split the word into fields */
+            for (const char *c = value; *c; c++) {
+                text_append(&scratch, *c == ' ' || *c == '\t' || *c == '\n' ? &(char) {FIELD_BREAK} : c, 1);
+            }
+            *wild |= strpbrk(value, "*?[") != NULL;
         } else {
+            (*missing)++;
+        }
+    }
+    if (!changed) {
+        return word;
+    }
+    text_append(&scratch, rest, strlen(rest));
+    char *expanded = arena_strndup(&line_arena, scratch.data, scratch.length);
+    return marked && !*wild && !strchr(expanded, FIELD_BREAK) ? strip_marks(expanded) : expanded;
+}
+
+/*
+ * Next field of an expanded word, cut in place at its FIELD_BREAKs, or
+ * NULL when there are no more. Without splitting the word is one field,
+ * even when empty.
+ */
+static char *next_field(char **cursor, int split) {
+    char *field = *cursor, *end;
+    if (!field || !split) {
+        *cursor = NULL;
+        return field;
+    }
+    while (*field == FIELD_BREAK) {
+        field++;
+    }
+    if (*field == '\0') {
+        *cursor = NULL;
+        return NULL;
+    }
+    for (end = field; *end && *end != FIELD_BREAK; end += *end == LITERAL_MARK && end[1] ? 2 : 1) {
+    }
+    *cursor = *end ? end + 1 : NULL;
+    *end = '\0';
+    return field;
+}
+
+/*
+ * Arguments of a command after expansion, NULL after reporting an error.
+ * Commands with nothing to expand get their parsed argv back without
+ * copying. An unquoted expansion is split into fields at blanks, so
+ * "set c = 'ls -l'" then "$c" runs ls with -l. An unquoted word that
+ * expands to nothing is dropped, and one with wildcards is replaced by the
+ * paths it matches (or kept as it is when nothing matches).
+ */
+static char **expand_command(const Node *node) {
+    static char **words; /* argv being built, copied into the arena at the end */
+    static int capacity;
+    int argc = 0, dollars = 0;
+    for (; node->argv[argc] != NULL; argc++) {
+        dollars |= strpbrk(node->argv[argc], EXPANSION_BYTES) != NULL;
+    }
+    if (!dollars) {
+        return node->argv;
+    }
+
+    uint64_t expand_start = monotonic_ns();
+    int count = 0;
+    for (int i = 0; i < argc; i++) {
+        int missing = 0, wild, fields = 0;
+        char *word = expand_word(node->argv[i], &missing, &wild), *field;
+        int split = strchr(word, FIELD_BREAK) != NULL;
+        for (char *cursor = word; (field = next_field(&cursor, split)) != NULL;) {
+            int matches = 0;
+            char **paths = NULL;
+            if (!wild || (matches = glob_word(field, &paths)) == 0) {
+                strip_marks(field);
+            }
+            if (field[0] == '\0' && (split || !strchr(node->argv[i], QUOTED_MARK))) {
+                continue;
+            }
+            if (count + matches + 2 > capacity) {
+                capacity = (count + matches + 2) * 2;
+                words = realloc(words, capacity * sizeof(char *));
+                if (!words) {
+                    fprintf(stderr, "allocation error in expand_command\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            if (matches) {
+                memcpy(words + count, paths, matches * sizeof(char *));
+                count += matches;
+            } else {
+                words[count++] = field;
+            }
+            fields++;
+        }
+        if (fields == 0 && i == 0 && missing) {
             printf("Variable not found\n");
-            return -1;
+            return NULL;
         }
     }
+    char **argv = arena_alloc(&line_arena, (count + 1) * sizeof(char *));
+    memcpy(argv, words, count * sizeof(char *));
+    argv[count] = NULL;
+    trace_event(TRACE_EXPAND, expand_start, monotonic_ns(), node->argv[0]);
+    return argv;
+}
 
-    /* Add a check for pstatus command with its arguments */
-    if (strcmp(args[0], "pstatus") == 0) {
-        if (args[1] != NULL) {
-            if (strcmp(args[1], "-p") == 0) {
-                return pstatus_p(args, background, output);
-            } else if (strcmp(args[1], "-i") == 0) {
-                return pstatus_i(args, background, output);
-            } else if (strcmp(args[1], "-t") == 0) {
-                return pstatus_t(args, background, output);
+// A redirect target after expansion, which must come to exactly one word; NULL after reporting an error
+static char *expand_target(char *word) {
+    int missing = 0, wild;
+    char **paths;
+    char *target = expand_word(word, &missing, &wild);
+    if (strchr(target, FIELD_BREAK)) {
+        char *cursor = target;
+        target = next_field(&cursor, 1);
+        if (!target || next_field(&cursor, 1)) {
+            fprintf(stderr, "%s: ambiguous redirect\n", strip_marks(word));
+            return NULL;
+        }
+    }
+    if (!wild) {
+        strip_marks(target);
+    } else {
+        int matches = glob_word(target, &paths);
+        if (matches > 1) {
+            fprintf(stderr, "%s: ambiguous redirect\n", strip_marks(target));
+            return NULL;
+        }
+        target = matches == 1 ? paths[0] : strip_marks(target);
+    }
+    if (target[0] == '\0') {
+        fprintf(stderr, "%s: ambiguous redirect\n", strip_marks(word));
+        return NULL;
+    }
+    return target;
+}
+
+/*
+ * Build the fd plan for a command's redirects, opening its files. Returns
+ * -1 after reporting an error, with nothing left open.
+ */
+static int plan_redirects(const Redirect *redirect, FdPlan *plan) {
+    plan->count = plan->open_count = 0;
+    for (int fd = 0; fd <= MAX_REDIRECT_FD; fd++) {
+        plan->target[fd] = fd;
+    }
+    for (; redirect; redirect = redirect->next) {
+        int fd = redirect->fd, source;
+        if (plan->count + 2 > MAX_PLAN_STEPS) {
+            fprintf(stderr, "too many redirections\n");
+            plan_close(plan);
+            return -1;
+        }
+        if (redirect->type == REDIRECT_DUP) {
+            char *target = expand_target(redirect->target);
+            if (!target) {
+                plan_close(plan);
+                return -1;
+            }
+            if (strcmp(target, "-") == 0) {
+                source = -1; /* close the fd */
+            } else if (isdigit((unsigned char) target[0]) && target[1] == '\0') {
+                source = target[0] - '0';
             } else {
-                printf("Invalid argument for pstatus\n");
+                fprintf(stderr, "%s: bad file descriptor\n", target);
+                plan_close(plan);
                 return -1;
             }
+            plan->target[fd] = source < 0 ? -1 : plan->target[source];
         } else {
-            printf("Usage: pstatus [-p|-i|-t]\n");
-            return -1;
+            char *path = expand_target(redirect->target);
+            int flags = redirect->type == REDIRECT_IN ? O_RDONLY
+                        : redirect->type == REDIRECT_APPEND || redirect->type == REDIRECT_BOTH_APPEND
+                          ? O_WRONLY | O_CREAT | O_APPEND : O_WRONLY | O_CREAT | O_TRUNC;
+            source = path ? open(path, flags | O_CLOEXEC, 0644) : -1;
+            if (source >= 0 && source < PLAN_FD_BASE) {
+                int moved = fcntl(source, F_DUPFD_CLOEXEC, PLAN_FD_BASE);
+                close(source);
+                source = moved;
+            }
+            if (source < 0) {
+                if (path) {
+                    perror(path);
+                }
+                plan_close(plan);
+                return -1;
+            }
+            plan->opened[plan->open_count++] = source;
+            plan->target[fd] = source;
+        }
+        plan->steps[plan->count].fd = fd;
+        plan->steps[plan->count++].source = source;
+        if (redirect->type == REDIRECT_BOTH || redirect->type == REDIRECT_BOTH_APPEND) {
+            plan->steps[plan->count].fd = STDERR_FILENO;
+            plan->steps[plan->count++].source = STDOUT_FILENO;
+            plan->target[STDERR_FILENO] = plan->target[STDOUT_FILENO];
         }
     }
+    return 0;
+}
 
-    /* Add a check for nw command with its arguments */
-    if (strcmp(args[0], "nw") == 0) {
-        return nw_handler(args, background, output);
+typedef struct {
+    FILE *saved[3];
+} BuiltinStreams;
+
+/*
+ * Give a builtin stdin, stdout and stderr streams over its redirect
+ * targets. Only the FILE pointers change: the shell's fds 0-2 stay as
+ * they are, so nothing has to be put back on those if the builtin exits.
+ */
+static void builtin_streams_open(const FdPlan *plan, BuiltinStreams *streams) {
+    FILE **standard[3] = {&stdin, &stdout, &stderr};
+    for (int fd = 0; fd < 3; fd++) {
+        streams->saved[fd] = NULL;
+        if (plan->target[fd] == fd) {
+            continue;
+        }
+        FILE *stream;
+        if (plan->target[fd] < 0) {
+            /* closed with >&-: a stream opened the wrong way round fails every read or write */
+            stream = fopen("/dev/null", fd == STDIN_FILENO ? "we" : "re");
+        } else {
+            int copy = fcntl(plan->target[fd], F_DUPFD_CLOEXEC, PLAN_FD_BASE);
+            stream = copy < 0 ? NULL : fdopen(copy, fd == STDIN_FILENO ? "r" : "w");
+            if (!stream && copy >= 0) {
+                close(copy);
+            }
+        }
+        if (!stream) {
+            continue;
+        }
+        if (fd == STDERR_FILENO) {
+            setvbuf(stream, NULL, _IONBF, 0);
+        }
+        fflush(*standard[fd]);
+        streams->saved[fd] = *standard[fd];
+        *standard[fd] = stream;
     }
+}
 
-    /* find if the command is a builtin */
-    for (; i < sizeof(builtin_func_list) / sizeof(char *); i++) {
-        /* if there is a match execute the builtin command */
-        if (strcmp(args[0], builtin_func_list[i]) == 0) {
-            if (builtin_func[i] == NULL) {
-                exit(0); // Exit command
+static void builtin_streams_close(BuiltinStreams *streams) {
+    FILE **standard[3] = {&stdin, &stdout, &stderr};
+    for (int fd = 0; fd < 3; fd++) {
+        if (streams->saved[fd]) {
+            fclose(*standard[fd]);
+            *standard[fd] = streams->saved[fd];
+        }
+    }
+}
+
+static int run_command(const Node *node, int background) {
+    FdPlan plan;
+    char **args = expand_command(node);
+    if (args == NULL || plan_redirects(node->redirects, &plan) < 0) {
+        return last_status = 1;
+    }
+    if (args[0] == NULL) {
+        /* a bare redirect only creates or truncates its files */
+        plan_close(&plan);
+        return last_status = 0;
+    }
+    char command_name[STATS_NAME_LENGTH]; /* builtins may rewrite args[0] */
+    snprintf(command_name, sizeof(command_name), "%s", args[0]);
+    const FdPlan *redirects = plan.count ? &plan : NULL;
+    BuiltinStreams streams;
+    /* a forked builtin gets its redirects on fds 0-2 and is announced on the shell's own stdout */
+    int builtin = redirects && is_builtin(args[0]) && !(background && builtin_runs_in_background(args));
+    if (builtin) {
+        builtin_streams_open(redirects, &streams);
+    }
+    uint64_t dispatch_start = monotonic_ns();
+    int status = execute(args, background, redirects);
+    if (builtin) {
+        builtin_streams_close(&streams);
+    }
+    plan_close(&plan);
+    uint64_t dispatch_end = monotonic_ns();
+    /* dispatch covers everything in execute() except spawning and waiting */
+    phase_add(PHASE_DISPATCH, dispatch_end - dispatch_start - phase_elapsed[PHASE_SPAWN] - phase_elapsed[PHASE_WAIT]);
+    record_command_stats(command_name);
+    trace_event(TRACE_DISPATCH, dispatch_start, dispatch_end, command_name);
+    fflush(stdout);
+    trace_event(TRACE_FLUSH, dispatch_end, monotonic_ns(), command_name);
+    return last_status = status == 0 ? 0 : 1;
+}
+
+// Body of a pipeline child: builtins run in it, anything else is exec'd directly
+static void run_stage(const Node *stage) {
+    FdPlan plan;
+    char **args = expand_command(stage);
+    if (args == NULL || plan_redirects(stage->redirects, &plan) < 0) {
+        _exit(EXIT_FAILURE);
+    }
+    if (args[0] == NULL || is_builtin(args[0])) {
+        /* this process is the stage's own, so its fds can simply be replaced */
+        if (plan_apply(&plan) < 0) {
+            perror("error in pipeline: redirect");
+            _exit(EXIT_FAILURE);
+        }
+        int status = args[0] == NULL ? 0 : execute(args, 0, NULL);
+        fflush(stdout);
+        _exit(status == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    exec_child(args, &plan);
+}
+
+static int run_pipeline(const Node *node) {
+    pid_t *pids = malloc(node->stage_count * sizeof(pid_t));
+    int started = 0, input = -1, status = 1;
+    if (!pids) {
+        perror("error in pipeline");
+        return 1;
+    }
+    fflush(stdout); /* the children must not repeat buffered output */
+    child_environment();
+    uint64_t spawn_start = monotonic_ns();
+    for (int i = 0; i < node->stage_count; i++) {
+        int fds[2] = {-1, -1};
+        if (i + 1 < node->stage_count && pipe2(fds, O_CLOEXEC) < 0) {
+            perror("error in pipeline: pipe");
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            trace_pid = getpid();
+            if (input >= 0) {
+                dup2(input, STDIN_FILENO);
+            }
+            if (fds[1] >= 0) {
+                dup2(fds[1], STDOUT_FILENO);
             }
-            return ((*builtin_func[i])(args, background, output));
+            run_stage(node->stages[i]);
         }
+        if (input >= 0) {
+            close(input);
+        }
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+        input = fds[0];
+        if (pid < 0) {
+            perror("error in pipeline: forking");
+            break;
+        }
+        pids[started++] = pid;
     }
-    /* create a new process */
-    return newProcess(args, background, output);
+    if (input >= 0) {
+        close(input);
+    }
+
+    uint64_t wait_start = monotonic_ns();
+    phase_add(PHASE_SPAWN, wait_start - spawn_start);
+    trace_event(TRACE_FORK, spawn_start, wait_start, node->stages[0]->argv[0]);
+    for (int i = 0; i < started; i++) {
+        int child_status;
+        struct rusage usage;
+        if (wait4(pids[i], &child_status, 0, &usage) < 0) {
+            continue;
+        }
+        add_rusage(&child_usage, &usage);
+        if (i == node->stage_count - 1) { /* the pipeline's status is that of its last command */
+            status = WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0 ? 0 : 1;
+        }
+    }
+    uint64_t wait_end = monotonic_ns();
+    phase_add(PHASE_WAIT, wait_end - wait_start);
+    trace_event(TRACE_WAITPID, wait_start, wait_end, node->stages[0]->argv[0]);
+    record_command_stats(node->stages[0]->argv[0] ? node->stages[0]->argv[0] : "|");
+    free(pids);
+    return last_status = status;
+}
+
+static int run_background(const Node *node) {
+    if (node->left->type == NODE_COMMAND) {
+        return run_command(node->left, 1);
+    }
+    fflush(stdout); /* the subshell must not repeat buffered output */
+    pid_t pid = fork();
+    if (pid == 0) {
+        trace_pid = getpid();
+        int status = run_node(node->left);
+        fflush(stdout);
+        _exit(status);
+    } else if (pid < 0) {
+        perror("error in run_background: forking a subshell");
+        return 1;
+    }
+    add_job(pid, node->text);
+    return 0;
+}
+
+/* Walk the tree; returns 0 on success like an exit status */
+static int run_node(const Node *node) {
+    int status = 0;
+    switch (node->type) {
+        case NODE_COMMAND:
+            return run_command(node, 0);
+        case NODE_PIPELINE:
+            return run_pipeline(node);
+        case NODE_AND:
+            status = run_node(node->left);
+            return status == 0 ? run_node(node->right) : status;
+        case NODE_OR:
+            status = run_node(node->left);
+            return status != 0 ? run_node(node->right) : status;
+        case NODE_SEQUENCE:
+            run_node(node->left);
+            return run_node(node->right);
+        case NODE_BACKGROUND:
+            return run_background(node);
+    }
+    return status;
 }
 
 void shell(void) {
     char *line;
-    char **args;
-    int status = -1;
-    gettimeofday(&start, NULL);
+    probe_nw_syscall();
+    load_history();
 
     char cwd[1024];
     char hostname[1024];
+    char prompt[2200];
     gethostname(hostname, sizeof(hostname));
     char *username = getlogin();
 
-    do {
+    for (;;) {
+        reap_jobs(1);
         getcwd(cwd, sizeof(cwd));
-        printf("%s@%s-%s$ ", username, hostname, cwd); /* print prompt symbol */
-        line = readLine();                             /* read line from stdin */
+        snprintf(prompt, sizeof(prompt), "%s@%s-%s$ ", username, hostname, cwd); /* prompt symbol */
+        uint64_t read_start = monotonic_ns();
+        line = readLine(prompt); /* read line from stdin */
+        trace_event(TRACE_READLINE, read_start, monotonic_ns(), NULL);
         char *temp = line;
         while (*temp) {
             if (*temp == '\n') {
@@ -639,78 +6333,38 @@ void shell(void) {
                 temp++;
             }
         }
-        if (strncmp(line, "set", 3) == 0) {
-            args = splitLine(line);
-            if (args[1] != NULL && args[2] != NULL && args[3] != NULL && strcmp(args[2], "=") == 0) {
-                setVariable(args[1], args[3]);
-            } else {
-                fprintf(stderr, "Usage: set varname = value\n");
+        if (line[0] == '!' && line[1] != '\0') {
+            char *expanded = expand_history(line);
+            if (!expanded) {
+                fprintf(stderr, "%s: event not found\n", line);
+                free(line);
+                continue;
             }
             free(line);
-            free(args);
-            continue;
+            line = expanded;
+            printf("%s\n", line);
+            fflush(stdout);
         }
-        if (strncmp(line, "get", 3) == 0) {
-            args = splitLine(line);
-            if (args[1] != NULL) {
-                char *value = getVariable(args[1]);
-                if (value) {
-                    printf("%s\n", value);
-                } else {
-                    printf("Variable not found\n");
-                }
-            } else {
-                fprintf(stderr, "Usage: get varname\n");
-            }
-            free(line);
-            free(args);
-            continue;
+        if (line[0] != '\0') {
+            history_add(line);
         }
-        if (line[0] == '$') {
-            char *var;
-            var = line + 1;
 
-            char *command = getVariable(var);
-            if (command == NULL)
-                printf("Variable not found\n");
-            else {
-                char **new_args = splitLine(command);
-                status = execute(new_args, 0, NULL);
-                free(new_args);
-            }
-            free(line);
-            continue;
+        uint64_t parse_start = monotonic_ns();
+        Node *tree = parse_line(line, &line_arena); /* the whole line, however many commands it holds */
+        uint64_t parse_end = monotonic_ns();
+        trace_event(TRACE_PARSE, parse_start, parse_end, tree ? line : NULL);
+        if (tree) {
+            phase_add(PHASE_PARSE, parse_end - parse_start); /* charged to the line's first command */
+            run_node(tree);
         }
-        int is_background = 0;
-        if (line[strlen(line) - 1] == '&') {
-            is_background = 1;
-            line[strlen(line) - 1] = '\0';
-        }
-        args = splitLine(line); /* tokenize line */
-        int i = 0;
-        char *outputfile = NULL;
-        while (args[i]) {
-            if (*(args[i]) == '>') {
-                outputfile = args[i + 1];
-                args[i] = NULL;
-                i++;
-                if (args[i] && strcmp(args[i], "&") == 0) {
-                    is_background = 1;
-                    args[i] = NULL;
-                }
-            }
-            i++;
-        }
-        status = execute(args, is_background, outputfile);
-        /* avoid memory leaks */
-        free(line);
-        free(args);
-        /* reset status for non-exit commands */
-        status = -1;
-    } while (status == -1);
+        arena_reset(&line_arena);
+        free(line); /* avoid memory leaks */
+    }
 }
 
+#ifndef SHELL_NO_MAIN
 int main() {
     shell();
     return 0;
 }
+#endif
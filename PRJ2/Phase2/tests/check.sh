@@ -0,0 +1,339 @@
+#!/bin/sh
+# Regression checks: feed command lines to ./shell and compare what it prints.
+# Run from PRJ2/Phase2 with "make check".
+SHELL_BIN=${SHELL_BIN:-./shell}
+WORK=$(mktemp -d /tmp/shell-check-XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+failures=0
+
+# expect NAME EXPECTED [SED]: run stdin through the shell with prompts
+# stripped, then through the optional sed script (to mask pids and the like).
+# History goes to $HIST when it is set.
+expect() {
+    actual=$(cd "$WORK" && HISTFILE=${HIST:-/dev/null} "$OLDPWD/$SHELL_BIN" 2>&1 | sed 's/^.*\$ //' | sed '/^$/d' |
+             sed -E "${3:-}")
+    if [ "$actual" = "$2" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        echo "  expected: $(printf '%s' "$2" | tr '\n' '|')"
+        echo "  actual:   $(printf '%s' "$actual" | tr '\n' '|')"
+        failures=$((failures + 1))
+    fi
+}
+
+# ;, && and || run their right side by the left side's status, as $? sees it
+expect "lists and \$?" "1
+and-ran
+or-ran
+chained" <<'LINES'
+false ; echo $?
+true && echo and-ran
+false && echo skipped
+false || echo or-ran
+true || echo skipped
+false || true && echo chained
+LINES
+
+expect "pipelines" "ABC
+y" <<'LINES'
+echo a b c | tr a-z A-Z | tr -d ' '
+printf 'x\ny\nz\n' | sort -r | head -2 | tail -1
+LINES
+
+expect "builtin in a pipeline" "HI
+3" <<'LINES'
+set v = hi
+get v | tr a-z A-Z
+get v | cat | wc -c
+LINES
+
+expect "background with jobs" "[N] N
+[N] N sleep N" 's/ +(Running|Done) +/ /; s/[0-9]+/N/g' <<'LINES'
+sleep 1 &
+jobs
+LINES
+
+expect "empty and comment lines" "done" <<'LINES'
+
+# a comment
+   # an indented comment
+echo done
+LINES
+
+# A dangling operator is reported and the shell reads on
+expect "syntax errors" "syntax error near unexpected newline
+syntax error near unexpected newline
+syntax error near unexpected token \`|'
+syntax error near unexpected token \`&&'
+survived" <<'LINES'
+echo x |
+echo x &&
+| echo x
+&&
+echo survived
+LINES
+
+# Single quotes keep everything, double quotes still expand $ and take \$, \"
+# and \\ as escapes, and an unquoted backslash quotes the next character
+expect "quotes and escapes" "single \$x \"q\" \\n
+double val 'q' \$x \"in\"
+a b\$x \\ c
+a\\b a\\b" <<'LINES'
+echo 'single $x "q" \n'
+set x = val
+echo "double $x 'q' \$x \"in\""
+echo a\ b\$x \\ c
+echo "a\b" 'a\b'
+LINES
+
+# # starts a comment only at the start of a word
+expect "comments" "word#hash #quoted #single" <<'LINES'
+echo word#hash "#quoted" '#single' # trailing comment
+LINES
+
+expect "unterminated quote" "syntax error: unterminated quote starting in \`'open'
+syntax error: unterminated quote starting in \`\"open'
+after" <<'LINES'
+echo 'open
+echo "open
+echo after
+LINES
+
+expect "redirects" "first
+second
+1
+2
+2
+echo: write error: Bad file descriptor
+1" <<'LINES'
+echo first > f
+echo second >> f
+cat < f
+ls nope 2> err
+wc -l < err
+ls nope f > both 2>&1
+wc -l < both
+ls nope f &> amp
+wc -l < amp
+echo closed >&-
+echo $?
+LINES
+
+# Files the shell opens for a redirect sit at fds >= PLAN_FD_BASE (10) with
+# O_CLOEXEC, so none of them may show up in the child
+expect "no fd leak" "0" <<'LINES'
+ls /proc/self/fd < f > fds 2> err
+awk '$1 >= 10' fds | wc -l
+LINES
+
+# Exported variables reach children, and every later set or export of one
+# rebuilds the cached environment
+expect "export" "1
+2
+3
+[]
+[4]" <<'LINES'
+export X=1
+sh -c 'echo $X'
+export X=2
+sh -c 'echo $X'
+set X = 3
+sh -c 'echo $X'
+set Y = 4
+sh -c 'echo [$Y]'
+export Y
+sh -c 'echo [$Y]'
+LINES
+
+# !n recalls an entry by number and !prefix the latest one starting with it;
+# the expanded line is echoed before it runs
+expect "history expansion" "one
+p
+echo one
+one
+printf \"p\\n\"
+p
+!9: event not found" <<'LINES'
+echo one
+printf "p\n"
+!1
+!pr
+!9
+LINES
+
+# A second shell reloads the first one's history from HISTFILE
+HIST="$WORK/history"
+expect "history written" "one" <<'LINES'
+echo one
+LINES
+expect "history reloaded" "    1  echo one
+    2  history
+echo one
+one" <<'LINES'
+history
+!1
+LINES
+unset HIST
+
+# parallel prints each job's output in argument order even when a later job
+# finishes first
+expect "parallel output order" "0.3
+0.1
+0.2
+parallel: 3 jobs, 3 succeeded, 0 failed" 's/ in [0-9.]+ s with up to [0-9]+ in flight//' <<'LINES'
+parallel -j 3 sh -c 'sleep $0; echo $0' ::: 0.3 0.1 0.2
+LINES
+
+# Each job counts the jobs running beside it; with -j 2 that never exceeds 2
+expect "parallel concurrency bound" "2" '/^parallel: /d' <<'LINES'
+parallel -j 2 sh -c 'touch run.$0; ls run.* | wc -l; sleep 0.3; rm run.$0' ::: a b c d e | sort -n | tail -1
+LINES
+
+# Failed jobs are listed and make the whole run fail
+expect "parallel exit status" "parallel: job 2 (1) exited with 1
+parallel: job 3 (2) exited with 2
+parallel: 4 jobs, 2 succeeded, 2 failed
+1" 's/ in [0-9.]+ s with up to [0-9]+ in flight//' <<'LINES'
+parallel -j 2 sh -c 'exit $0' ::: 0 1 2 0
+echo $?
+LINES
+
+# Names the shell has not set come from its environment; its own win
+mkdir -p "$WORK/envdir"
+touch "$WORK/envdir/marker"
+CHECK_VALUE=inherited CHECK_DIR=envdir
+export CHECK_VALUE CHECK_DIR
+expect "environment variables" "inherited
+marker
+shell" <<'LINES'
+echo $CHECK_VALUE
+cd $CHECK_DIR
+ls
+set CHECK_VALUE = shell
+echo $CHECK_VALUE
+LINES
+unset CHECK_VALUE CHECK_DIR
+
+# time reports an external command's own peak RSS; for a builtin only the
+# shell's peak exists, and it is labelled as such
+expect "time maxrss" "maxrss N KB
+maxrss N KB (shell)" '/^maxrss/!d; s/\t/ /; s/[0-9]+/N/' <<'LINES'
+time echo a
+time get nothing
+LINES
+
+# Another shell truncating the history file must not take away the lines
+# this one loaded at startup
+HIST="$WORK/long_history"
+seq 1000 | sed 's/^/echo line /' > "$HIST"
+expect "history file truncated" " 1000  echo line 1000
+ 1001  sh -c ': > \"\$HISTFILE\"'
+ 1002  history 3" <<'LINES'
+sh -c ': > "$HISTFILE"'
+history 3
+LINES
+unset HIST
+
+# A relative glob must not reuse the listing of the previous cwd, even when
+# both directories carry the same mtime
+mkdir -p "$WORK/a" "$WORK/b"
+touch "$WORK/a/one" "$WORK/a/two" "$WORK/b/three"
+touch -d '2020-01-01 00:00:00' "$WORK/a" "$WORK/b"
+expect "glob after cd" "one two
+three" <<'LINES'
+cd a
+echo *
+cd ../b
+echo *
+LINES
+
+# An unquoted expansion is split into fields, so a variable can hold a
+# command with its arguments; a quoted one stays a single word
+expect "field splitting" "a b
+echo a  b
+x y" <<'LINES'
+set c = "echo a  b"
+$c
+echo "$c"
+set e = " "
+echo x $e y
+LINES
+
+# Collectors given & run as jobs so the prompt comes back at once, and the
+# job announcement stays on the terminal when the builtin's stdout is redirected
+expect "builtins with &" "[N] N
+[N] N
+[N] N sysfo
+[N] N nw -s" 's/ +(Running|Done) +/ /; s/[0-9]+/N/g' <<'LINES'
+sysfo > /dev/null &
+nw -s > /dev/null &
+jobs
+LINES
+
+# A redirect of sysfo also covers the top it runs: nothing reaches the
+# terminal and top's header lands in the file
+expect "sysfo > file" "" <<'LINES'
+sysfo > sysfo.txt
+LINES
+if ! grep -q "^ *PID " "$WORK/sysfo.txt"; then
+    echo "FAIL sysfo > file: top output missing from the file"
+    failures=$((failures + 1))
+fi
+
+# nw -p must notice a process that closed a socket and opened another on the
+# same fd, which leaves /proc/<pid>/fd looking unchanged
+if command -v python3 >/dev/null; then
+    cat > "$WORK/swap.py" <<'PY'
+import os, socket, sys, time
+work = sys.argv[1]
+tcp = socket.socket()
+tcp.bind(("127.0.0.1", 0))
+tcp.listen()
+open(work + "/pid", "w").write(str(os.getpid()))
+while not os.path.exists(work + "/swap"):
+    time.sleep(0.02)
+os.close(tcp.detach())
+udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+udp.bind(("127.0.0.1", 0))
+time.sleep(5)
+PY
+    python3 "$WORK/swap.py" "$WORK" &
+    swapper=$!
+    while [ ! -s "$WORK/pid" ]; do sleep 0.05; done
+    actual=$(printf 'nw -p\n> swap\nsleep 0.3\nnw -p\n' | (cd "$WORK" && HISTFILE=/dev/null "$OLDPWD/$SHELL_BIN" 2>&1) |
+             grep "^$swapper" | sed 's/^.*\t//; s/ *$//')
+    kill $swapper
+    if [ "$actual" = "LISTEN:1
+UDP:1" ]; then
+        echo "ok   nw -p socket swap"
+    else
+        echo "FAIL nw -p socket swap: $(printf '%s' "$actual" | tr '\n' '|')"
+        failures=$((failures + 1))
+    fi
+fi
+
+# A writer killed while it held the nw baseline leaves the sequence odd and
+# its pid in owner; the next nw -r must take the record over, not give up
+if command -v python3 >/dev/null && [ -w /dev/shm ]; then
+    sh -c 'exit 0' &
+    dead=$!
+    wait $dead
+    printf 'nw -r\n' | HISTFILE=/dev/null "$SHELL_BIN" >/dev/null 2>&1
+    python3 - "$dead" <<'PY'
+import mmap, os, struct, sys
+fd = os.open("/dev/shm/nw_baseline", os.O_RDWR)
+shared = mmap.mmap(fd, 8)
+sequence = struct.unpack_from("I", shared, 0)[0]
+struct.pack_into("Ii", shared, 0, sequence | 1, int(sys.argv[1]))
+PY
+    actual=$(printf 'nw -r\nnw -m\n' | HISTFILE=/dev/null "$SHELL_BIN" 2>&1 | grep -c "Time since baseline")
+    if [ "$actual" = 1 ]; then
+        echo "ok   nw -r after a killed writer"
+    else
+        echo "FAIL nw -r after a killed writer"
+        failures=$((failures + 1))
+    fi
+fi
+
+[ "$failures" -eq 0 ] || { echo "$failures check(s) failed"; exit 1; }